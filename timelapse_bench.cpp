@@ -0,0 +1,325 @@
+// Microbenchmarks for the per-frame kernels of timelapse_viewer: image decoding
+// by format and resolution, pixel format conversion, resizing, texture upload
+// and the aspect-fit computation. Images are synthesized and encoded in memory,
+// so it needs no input files. Each result is one JSON object per line on stdout.
+//
+//   g++ -std=c++17 -O2 timelapse_bench.cpp -o timelapse_bench -lSDL2 -lSDL2_image -pthread
+//   ./timelapse_bench [--filter TEXT] [--seconds S]
+#define THD_NO_MAIN
+#include "timelapse_viewer.cpp"
+
+namespace {
+
+struct BenchOptions {
+    std::string filter;    // Only run benchmarks whose name contains this
+    double seconds = 0.5;  // Minimum time spent on each benchmark
+};
+
+struct Resolution {
+    const char* name;
+    int width;
+    int height;
+};
+
+const Resolution resolutions[] = {
+    {"vga", 640, 480},
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+};
+
+// Smooth gradients with a little noise, so encoders see something like a photo
+SDL_Surface* syntheticImage(int width, int height) {
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 24, SDL_PIXELFORMAT_RGB24);
+    if (!surface) {
+        return nullptr;
+    }
+    uint32_t seed = 12345;
+    for (int y = 0; y < height; ++y) {
+        Uint8* row = static_cast<Uint8*>(surface->pixels) + static_cast<size_t>(y) * surface->pitch;
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            int noise = static_cast<int>(seed >> 28) - 8;
+            row[x * 3] = static_cast<Uint8>(std::clamp(x * 255 / width + noise, 0, 255));
+            row[x * 3 + 1] = static_cast<Uint8>(std::clamp(y * 255 / height + noise, 0, 255));
+            row[x * 3 + 2] = static_cast<Uint8>(std::clamp((x + y) * 255 / (width + height) + noise, 0, 255));
+        }
+    }
+    return surface;
+}
+
+// Encodes a surface as "bmp", "png" or "jpeg" into memory
+EncodedBytes encodeImage(SDL_Surface* surface, const std::string& format, std::string& error) {
+    auto buffer = std::make_shared<std::vector<Uint8>>(static_cast<size_t>(surface->w) * surface->h * 4 + 65536);
+    SDL_RWops* out = SDL_RWFromMem(buffer->data(), static_cast<int>(buffer->size()));
+    if (!out) {
+        error = SDL_GetError();
+        return nullptr;
+    }
+    int result = -1;
+    if (format == "bmp") {
+        result = SDL_SaveBMP_RW(surface, out, 0);
+    } else if (format == "png") {
+        result = IMG_SavePNG_RW(surface, out, 0);
+    } else if (format == "jpeg") {
+        result = IMG_SaveJPG_RW(surface, out, 0, 90);
+    }
+    Sint64 size = SDL_RWtell(out);
+    SDL_RWclose(out);
+    if (result != 0 || size <= 0) {
+        error = IMG_GetError();
+        return nullptr;
+    }
+    buffer->resize(static_cast<size_t>(size));
+    return buffer;
+}
+
+// Runs `body` until both a few iterations and the minimum time have passed,
+// after one untimed warm-up call, and prints the result as a JSON line.
+// `bytes` is the data one call processes, for the MB/s figure.
+void measure(const BenchOptions& options, const std::string& name, const std::string& variant,
+             int width, int height, uint64_t bytes, const std::function<bool()>& body) {
+    std::string fullName = name + "/" + variant;
+    if (!options.filter.empty() && fullName.find(options.filter) == std::string::npos) {
+        return;
+    }
+    if (!body()) {
+        std::cerr << "Skipping " << fullName << ": " << SDL_GetError() << std::endl;
+        return;
+    }
+    
+    using Clock = std::chrono::steady_clock;
+    LatencyHistogram latency;
+    auto start = Clock::now();
+    double elapsed = 0.0;
+    while (latency.count() < 5 || elapsed < options.seconds) {
+        auto callStart = Clock::now();
+        if (!body()) {
+            std::cerr << "Failed " << fullName << ": " << SDL_GetError() << std::endl;
+            return;
+        }
+        auto now = Clock::now();
+        latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - callStart).count()));
+        elapsed = std::chrono::duration<double>(now - start).count();
+    }
+    
+    double seconds = latency.mean() * latency.count() / 1e9;
+    std::cout << "{\"benchmark\": \"" << name << "\", \"variant\": \"" << variant << "\""
+              << ", \"width\": " << width << ", \"height\": " << height
+              << ", \"iterations\": " << latency.count()
+              << ", \"per_s\": " << (seconds > 0 ? latency.count() / seconds : 0.0)
+              << ", \"mb_per_s\": " << (seconds > 0 ? bytes * latency.count() / (1024.0 * 1024.0) / seconds : 0.0)
+              << ", \"latency\": ";
+    latency.writeJson(std::cout);
+    std::cout << "}" << std::endl;
+}
+
+void benchmarkDecode(const BenchOptions& options) {
+    for (const Resolution& resolution : resolutions) {
+        SDL_Surface* image = syntheticImage(resolution.width, resolution.height);
+        if (!image) {
+            continue;
+        }
+        for (const char* format : {"bmp", "png", "jpeg"}) {
+            std::string error;
+            EncodedBytes bytes = encodeImage(image, format, error);
+            if (!bytes) {
+                std::cerr << "Unable to encode " << format << ": " << error << std::endl;
+                continue;
+            }
+            ImageSource source{std::string("synthetic.") + format, bytes};
+            measure(options, "decode", std::string(format) + "/" + resolution.name,
+                    resolution.width, resolution.height, bytes->size(), [&source]() {
+                std::string error;
+                SDL_Surface* surface = loadSurface(source, SDL_PIXELFORMAT_UNKNOWN, error);
+                SDL_FreeSurface(surface);
+                return surface != nullptr;
+            });
+        }
+        SDL_FreeSurface(image);
+    }
+}
+
+// PixelConverter, as the decode threads use it, against SDL's own conversion
+void benchmarkConvert(const BenchOptions& options, Uint32 textureFormat) {
+    const Resolution& resolution = resolutions[1];
+    SDL_Surface* image = syntheticImage(resolution.width, resolution.height);
+    if (!image) {
+        return;
+    }
+    uint64_t bytes = static_cast<uint64_t>(image->w) * image->h * 4;
+    std::vector<Uint32> formats = {textureFormat};
+    if (textureFormat != SDL_PIXELFORMAT_ABGR8888) {
+        formats.push_back(SDL_PIXELFORMAT_ABGR8888);
+    }
+    for (Uint32 format : formats) {
+        std::string target = SDL_GetPixelFormatName(format);
+        SDL_Surface* converted = SDL_CreateRGBSurfaceWithFormat(0, image->w, image->h, 32, format);
+        if (!converted) {
+            continue;
+        }
+        PixelConverter converter(image->format->format, format);
+        if (converter.valid()) {
+            measure(options, "convert", "rgb24-to-" + target + "/converter", image->w, image->h, bytes,
+                    [image, converted, &converter]() {
+                for (int y = 0; y < image->h; ++y) {
+                    converter.convertRow(static_cast<const Uint8*>(image->pixels) + static_cast<size_t>(y) * image->pitch,
+                                         static_cast<Uint8*>(converted->pixels) + static_cast<size_t>(y) * converted->pitch,
+                                         image->w);
+                }
+                return true;
+            });
+        }
+        measure(options, "convert", "rgb24-to-" + target + "/sdl", image->w, image->h, bytes,
+                [image, converted, format]() {
+            return SDL_ConvertPixels(image->w, image->h, image->format->format, image->pixels, image->pitch,
+                                     format, converted->pixels, converted->pitch) == 0;
+        });
+        SDL_FreeSurface(converted);
+    }
+    SDL_FreeSurface(image);
+}
+
+void benchmarkResize(const BenchOptions& options) {
+    std::vector<size_t> threadCounts = {1};
+    if (std::thread::hardware_concurrency() > 1) {
+        threadCounts.push_back(std::thread::hardware_concurrency());
+    }
+    struct Case {
+        const Resolution& from;
+        const Resolution& to;
+    };
+    for (const Case& resize : {Case{resolutions[2], resolutions[1]}, Case{resolutions[1], resolutions[0]}}) {
+        SDL_Surface* image = syntheticImage(resize.from.width, resize.from.height);
+        if (!image) {
+            continue;
+        }
+        for (size_t threads : threadCounts) {
+            std::string variant = std::string(resize.from.name) + "-to-" + resize.to.name + "/threads-" + std::to_string(threads);
+            uint64_t bytes = static_cast<uint64_t>(image->pitch) * image->h;
+            measure(options, "resize", variant, resize.to.width, resize.to.height, bytes,
+                    [image, &resize, threads]() {
+                std::string error;
+                SDL_Surface* resized = Resampler::resample(image, resize.to.width, resize.to.height, threads, error);
+                SDL_FreeSurface(resized);
+                return resized != nullptr;
+            });
+        }
+        SDL_FreeSurface(image);
+    }
+}
+
+// A new texture per frame against rewriting one streaming texture
+void benchmarkUpload(const BenchOptions& options, SDL_Renderer* renderer, Uint32 textureFormat) {
+    for (const Resolution& resolution : resolutions) {
+        SDL_Surface* image = syntheticImage(resolution.width, resolution.height);
+        std::string error;
+        SDL_Surface* converted = convertSurface(image, textureFormat, error);
+        if (!converted) {
+            continue;
+        }
+        uint64_t bytes = static_cast<uint64_t>(converted->pitch) * converted->h;
+        measure(options, "upload", std::string("create-texture/") + resolution.name,
+                converted->w, converted->h, bytes, [renderer, converted]() {
+            SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, converted);
+            if (texture) {
+                SDL_DestroyTexture(texture);
+            }
+            return texture != nullptr;
+        });
+        
+        SDL_Texture* streaming = SDL_CreateTexture(renderer, textureFormat, SDL_TEXTUREACCESS_STREAMING,
+                                                   converted->w, converted->h);
+        if (streaming) {
+            measure(options, "upload", std::string("update-texture/") + resolution.name,
+                    converted->w, converted->h, bytes, [streaming, converted]() {
+                return SDL_UpdateTexture(streaming, nullptr, converted->pixels, converted->pitch) == 0;
+            });
+            UploadStats stats;
+            measure(options, "upload", std::string("lock-texture/") + resolution.name,
+                    converted->w, converted->h, bytes, [streaming, converted, textureFormat, &stats]() {
+                return writeStreamingTexture(streaming, textureFormat, converted->w, converted->h,
+                                             converted->format->format, converted->pixels, converted->pitch, stats);
+            });
+            SDL_DestroyTexture(streaming);
+        }
+        SDL_FreeSurface(converted);
+    }
+}
+
+// Keeps the compiler from dropping the aspect-fit loop
+volatile int aspectFitSink = 0;
+
+// A batch of fits per call, since one is only a few nanoseconds
+void benchmarkAspectFit(const BenchOptions& options) {
+    const int batch = 1000;
+    measure(options, "aspect-fit", "batch-1000", 0, 0, 0, []() {
+        int total = 0;
+        for (int i = 0; i < batch; ++i) {
+            SDL_Rect rect = aspectFit(1920 + i, 1080 + (i & 255), 1280 + (i & 63), 720);
+            total += rect.x + rect.w;
+        }
+        aspectFitSink = total;
+        return true;
+    });
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--filter") {
+            if (i + 1 < argc) {
+                options.filter = argv[++i];
+            }
+        } else if (arg == "--seconds") {
+            if (i + 1 < argc) {
+                options.seconds = std::stod(argv[++i]);
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
+            std::cout << "Options:" << std::endl;
+            std::cout << "  --filter TEXT   Only run benchmarks whose name/variant contains TEXT" << std::endl;
+            std::cout << "  --seconds S     Minimum time per benchmark (default: 0.5)" << std::endl;
+            std::cout << "  -h, --help      Show this help message" << std::endl;
+            return 0;
+        }
+    }
+    
+    // Texture uploads need a renderer; without a display use the software one
+    setenv("SDL_VIDEODRIVER", "dummy", 0);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+    SDL_Window* window = SDL_CreateWindow("timelapse_bench", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                          1280, 720, SDL_WINDOW_HIDDEN);
+    SDL_Renderer* renderer = window ? SDL_CreateRenderer(window, -1, 0) : nullptr;
+    Uint32 textureFormat = FrameCache::defaultTextureFormat;
+    SDL_RendererInfo rendererInfo;
+    if (renderer && SDL_GetRendererInfo(renderer, &rendererInfo) == 0) {
+        textureFormat = preferredTextureFormat(rendererInfo, textureFormat);
+    }
+    
+    benchmarkDecode(options);
+    benchmarkConvert(options, textureFormat);
+    benchmarkResize(options);
+    if (renderer) {
+        benchmarkUpload(options, renderer, textureFormat);
+    } else {
+        std::cerr << "Skipping upload benchmarks, no renderer: " << SDL_GetError() << std::endl;
+    }
+    benchmarkAspectFit(options);
+    
+    if (renderer) {
+        SDL_DestroyRenderer(renderer);
+    }
+    if (window) {
+        SDL_DestroyWindow(window);
+    }
+    IMG_Quit();
+    SDL_Quit();
+    return 0;
+}
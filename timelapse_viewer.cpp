@@ -6,15 +6,4767 @@
 #include <filesystem>
 #include <algorithm>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <string_view>
+#include <shared_mutex>
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef THD_WITH_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#ifdef THD_WITH_LIBJPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
 
 namespace fs = std::filesystem;
 
+// Blocking FIFO with a fixed capacity; producers wait while it is full
+template <typename T>
+class BoundedQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BoundedQueue(size_t maxItems) : capacity(std::max<size_t>(1, maxItems)) {}
+    
+    // Returns false if the queue was closed before the item could be added
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    // Returns false once the queue is closed and drained
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        out = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    
+    bool tryPop(T& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) {
+            return false;
+        }
+        out = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+// --trace: timed spans from every thread, written in Chrome trace-event format
+// for chrome://tracing or Perfetto. Each thread records into a ring buffer of
+// its own, so a span costs two clock reads and a store with no lock; a thread
+// takes the lock once, to register its ring on its first span. A ring that
+// wraps keeps the newest spans.
+class TraceRecorder {
+public:
+    struct Event {
+        const char* name = nullptr;  // String literal, kept by pointer
+        uint64_t startNs = 0;
+        uint64_t durationNs = 0;
+        int64_t frame = -1;          // Frame index, or -1
+    };
+
+private:
+    static constexpr size_t ringEvents = size_t(1) << 16;
+    
+    struct ThreadRing {
+        uint32_t id;
+        std::string name;
+        std::vector<Event> events;
+        std::atomic<uint64_t> written{0};
+        
+        explicit ThreadRing(uint32_t threadId) : id(threadId), events(ringEvents) {}
+    };
+    
+    struct ThreadSlot {
+        uint64_t serial = 0;
+        ThreadRing* ring = nullptr;
+    };
+    
+    static inline std::atomic<TraceRecorder*> active{nullptr};
+    static inline std::atomic<uint64_t> serials{0};
+    
+    uint64_t serial = ++serials;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex ringsMutex;
+    std::vector<std::unique_ptr<ThreadRing>> rings;
+    
+    // The calling thread's ring, registered on first use
+    ThreadRing& threadRing() {
+        thread_local ThreadSlot slot;
+        if (slot.serial != serial) {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            rings.push_back(std::make_unique<ThreadRing>(static_cast<uint32_t>(rings.size() + 1)));
+            slot.serial = serial;
+            slot.ring = rings.back().get();
+        }
+        return *slot.ring;
+    }
+
+public:
+    TraceRecorder() = default;
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+    
+    ~TraceRecorder() {
+        stop();
+    }
+    
+    // The recorder spans go to, or null when tracing is off
+    static TraceRecorder* current() {
+        return active.load(std::memory_order_acquire);
+    }
+    
+    // Everything that records must stop before the recorder is destroyed
+    void start() {
+        active.store(this, std::memory_order_release);
+    }
+    
+    void stop() {
+        TraceRecorder* self = this;
+        active.compare_exchange_strong(self, nullptr);
+    }
+    
+    // Labels the calling thread's track
+    static void nameThread(const std::string& name) {
+        if (TraceRecorder* recorder = current()) {
+            ThreadRing& ring = recorder->threadRing();
+            std::lock_guard<std::mutex> lock(recorder->ringsMutex);
+            ring.name = name;
+        }
+    }
+    
+    void record(const char* name, std::chrono::steady_clock::time_point start, 
+                std::chrono::steady_clock::time_point end, int64_t frame) {
+        ThreadRing& ring = threadRing();
+        uint64_t next = ring.written.load(std::memory_order_relaxed);
+        Event& event = ring.events[next % ringEvents];
+        event.name = name;
+        event.startNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin).count());
+        event.durationNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        event.frame = frame;
+        ring.written.store(next + 1, std::memory_order_release);
+    }
+    
+    // Writes every thread's spans as complete ("X") events. The threads that
+    // recorded them should have finished, or their newest spans may be torn.
+    bool write(const std::string& path, std::string& error) {
+        std::ofstream out(path);
+        if (!out) {
+            error = std::strerror(errno);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+        bool first = true;
+        char line[256];
+        for (const auto& ring : rings) {
+            std::string name = ring->name.empty() ? "thread " + std::to_string(ring->id) : ring->name;
+            out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " 
+                << ring->id << ", \"args\": {\"name\": \"" << name << "\"}}";
+            first = false;
+            
+            uint64_t written = ring->written.load(std::memory_order_acquire);
+            for (uint64_t i = written > ringEvents ? written - ringEvents : 0; i < written; ++i) {
+                const Event& event = ring->events[i % ringEvents];
+                int length = std::snprintf(line, sizeof(line), 
+                    ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f", 
+                    event.name, ring->id, event.startNs / 1000.0, event.durationNs / 1000.0);
+                out.write(line, length);
+                if (event.frame >= 0) {
+                    out << ", \"args\": {\"frame\": " << event.frame << "}";
+                }
+                out << "}";
+            }
+        }
+        out << std::endl << "]}" << std::endl;
+        if (!out) {
+            error = std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Records the enclosing block as a span when tracing is on
+class TraceScope {
+private:
+    TraceRecorder* recorder;
+    const char* name;
+    int64_t frame;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit TraceScope(const char* spanName, int64_t frameIndex = -1)
+        : recorder(TraceRecorder::current()), name(spanName), frame(frameIndex) {
+        if (recorder) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+    
+    ~TraceScope() {
+        if (recorder) {
+            recorder->record(name, start, std::chrono::steady_clock::now(), frame);
+        }
+    }
+};
+
+// One plane of 8-bit samples (interleaved channels for packed RGB)
+struct PixelPlane {
+    Uint8* pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    int pitch = 0;
+};
+
+// Planar 8-bit YUV 4:2:0 frame in SDL_PIXELFORMAT_IYUV layout: a full size Y
+// plane followed by the U and V planes at half width and height, tightly packed
+struct YuvFrame {
+    int width = 0;
+    int height = 0;
+    std::vector<Uint8> pixels;
+    
+    YuvFrame(int frameWidth, int frameHeight)
+        : width(frameWidth), height(frameHeight),
+          pixels(static_cast<size_t>(frameWidth) * frameHeight + 
+                 2 * static_cast<size_t>((frameWidth + 1) / 2) * ((frameHeight + 1) / 2)) {}
+    
+    int chromaWidth() const {
+        return (width + 1) / 2;
+    }
+    
+    int chromaHeight() const {
+        return (height + 1) / 2;
+    }
+    
+    // 0 = Y, 1 = U, 2 = V
+    PixelPlane plane(int index) {
+        size_t lumaBytes = static_cast<size_t>(width) * height;
+        size_t chromaBytes = static_cast<size_t>(chromaWidth()) * chromaHeight();
+        if (index == 0) {
+            return {pixels.data(), width, height, width};
+        }
+        return {pixels.data() + lumaBytes + (index - 1) * chromaBytes, chromaWidth(), chromaHeight(), chromaWidth()};
+    }
+};
+
+struct DecodedFrame {
+    size_t index = 0;
+    SDL_Surface* surface = nullptr;
+    std::unique_ptr<YuvFrame> yuv;     // Set instead of surface for planar YUV decodes
+    std::string error;
+    double decodeMs = 0.0;
+    uint32_t generation = 0;    // Display target the frame was sized for
+    bool wantFullResolution = false;
+    bool fullResolution = true; // False when decoded at a reduced preview scale
+    bool opaque = true;         // No alpha channel, so it can be drawn without blending
+    
+    bool hasPixels() const {
+        return surface || yuv;
+    }
+};
+
+// Worker threads that decode frames off the render thread. Results are handed
+// back through a bounded queue so at most a few surfaces are in flight at once;
+// texture creation stays with whoever owns the renderer.
+class DecodePool {
+private:
+    std::function<void(DecodedFrame&)> decode;
+    std::vector<std::thread> workers;
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    struct Job {
+        size_t index;
+        bool fullResolution;
+    };
+    std::deque<Job> jobs;
+    bool stopping = false;
+    BoundedQueue<DecodedFrame> results;
+
+    void workerLoop() {
+        TraceRecorder::nameThread("decode");
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            
+            DecodedFrame frame;
+            frame.index = job.index;
+            frame.wantFullResolution = job.fullResolution;
+            auto decodeStart = std::chrono::steady_clock::now();
+            decode(frame);
+            frame.decodeMs = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - decodeStart).count();
+            SDL_Surface* surface = frame.surface;
+            if (!results.push(std::move(frame)) && surface) {
+                SDL_FreeSurface(surface);
+            }
+        }
+    }
+
+public:
+    DecodePool(size_t threadCount, size_t resultCapacity,
+               std::function<void(DecodedFrame&)> decodeFn)
+        : decode(std::move(decodeFn)), results(resultCapacity) {
+        threadCount = std::max<size_t>(1, threadCount);
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.emplace_back(&DecodePool::workerLoop, this);
+        }
+    }
+    
+    ~DecodePool() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        results.close();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        DecodedFrame leftover;
+        while (results.tryPop(leftover)) {
+            if (leftover.surface) {
+                SDL_FreeSurface(leftover.surface);
+            }
+        }
+    }
+    
+    size_t threadCount() const {
+        return workers.size();
+    }
+    
+    // Full resolution jobs skip any reduced-scale preview decoding
+    void submit(size_t index, bool fullResolution = false) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            jobs.push_back({index, fullResolution});
+        }
+        jobReady.notify_one();
+    }
+    
+    // Removes queued jobs that have not started yet and returns their indices
+    std::vector<size_t> cancelIf(const std::function<bool(size_t)>& shouldCancel) {
+        std::vector<size_t> cancelled;
+        std::lock_guard<std::mutex> lock(jobMutex);
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            if (shouldCancel(it->index)) {
+                cancelled.push_back(it->index);
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return cancelled;
+    }
+    
+    // Blocks until the next decoded frame is available (in completion order)
+    bool waitResult(DecodedFrame& out) {
+        return results.pop(out);
+    }
+    
+    bool tryResult(DecodedFrame& out) {
+        return results.tryPop(out);
+    }
+};
+
+// Long-lived threads that split one frame's work, such as resample bands or
+// LZ4 blocks, across cores. Starting threads for every frame would cost more
+// than the work they split. The caller works through its own parts as well,
+// so a call completes even while every helper is busy with another caller's.
+class HelperPool {
+private:
+    struct Batch {
+        const std::function<void(size_t)>* part;
+        size_t count;
+        std::atomic<size_t> next{0};
+        size_t done = 0;    // Guarded by the pool's mutex
+    };
+    
+    std::vector<std::thread> helpers;
+    std::mutex mutex;
+    std::condition_variable workReady;
+    std::condition_variable batchDone;
+    std::deque<std::shared_ptr<Batch>> batches;
+    bool stopping = false;
+    
+    void finish(Batch& batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (++batch.done == batch.count) {
+            batchDone.notify_all();
+        }
+    }
+    
+    void helperLoop() {
+        TraceRecorder::nameThread("helper");
+        while (true) {
+            std::shared_ptr<Batch> batch;
+            size_t part;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workReady.wait(lock, [this] { return stopping || !batches.empty(); });
+                if (stopping) {
+                    return;
+                }
+                batch = batches.front();
+                part = batch->next++;
+                if (part + 1 >= batch->count) {
+                    batches.pop_front();
+                }
+                if (part >= batch->count) {
+                    continue;
+                }
+            }
+            (*batch->part)(part);
+            finish(*batch);
+        }
+    }
+
+public:
+    explicit HelperPool(size_t threadCount) {
+        for (size_t i = 0; i < threadCount; ++i) {
+            helpers.emplace_back(&HelperPool::helperLoop, this);
+        }
+    }
+    
+    ~HelperPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workReady.notify_all();
+        for (auto& helper : helpers) {
+            helper.join();
+        }
+    }
+    
+    // One helper per core besides the caller's, started on first use
+    static HelperPool& shared() {
+        static HelperPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+    
+    // Runs part(0) .. part(count - 1) across the helpers and the calling
+    // thread, returning once all of them have finished
+    void run(size_t count, const std::function<void(size_t)>& part) {
+        if (count <= 1 || helpers.empty()) {
+            for (size_t i = 0; i < count; ++i) {
+                part(i);
+            }
+            return;
+        }
+        
+        auto batch = std::make_shared<Batch>();
+        batch->part = &part;
+        batch->count = count;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batches.push_back(batch);
+        }
+        workReady.notify_all();
+        
+        for (size_t i = batch->next++; i < count; i = batch->next++) {
+            part(i);
+            finish(*batch);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        batchDone.wait(lock, [&batch] { return batch->done == batch->count; });
+    }
+};
+
+// Encoded bytes of an image file held in memory
+using EncodedBytes = std::shared_ptr<const std::vector<Uint8>>;
+
+// An image to decode: read from memory when its bytes are loaded, else from its file
+struct ImageSource {
+    std::string path;
+    EncodedBytes bytes;
+};
+
+// Decodes an image file into a surface of the requested pixel format. With
+// SDL_PIXELFORMAT_UNKNOWN the decoder's own format is kept whenever
+// SDL_ConvertPixels can read it, so the conversion can be fused with the upload.
+SDL_Surface* loadSurface(const ImageSource& source, Uint32 format, std::string& error) {
+    TraceScope span("load image");
+    SDL_Surface* surface = source.bytes 
+        ? IMG_Load_RW(SDL_RWFromConstMem(source.bytes->data(), static_cast<int>(source.bytes->size())), 1)
+        : IMG_Load(source.path.c_str());
+    if (!surface) {
+        error = IMG_GetError();
+        return nullptr;
+    }
+    
+    Uint32 native = surface->format->format;
+    if (format == SDL_PIXELFORMAT_UNKNOWN) {
+        if (!SDL_ISPIXELFORMAT_INDEXED(native) && SDL_BYTESPERPIXEL(native) >= 2) {
+            return surface;
+        }
+        // Palettes only need alpha when a colour is transparent
+        format = SDL_HasColorKey(surface) ? SDL_PIXELFORMAT_ARGB8888 : SDL_PIXELFORMAT_RGB888;
+    }
+    
+    if (native != format) {
+        SDL_Surface* converted = SDL_ConvertSurfaceFormat(surface, format, 0);
+        SDL_FreeSurface(surface);
+        if (!converted) {
+            error = SDL_GetError();
+        }
+        surface = converted;
+    }
+    return surface;
+}
+
+// Largest size with the source aspect ratio that fits within maxWidth x maxHeight.
+// Never scales up.
+void fitWithin(int sourceWidth, int sourceHeight, int maxWidth, int maxHeight, int& width, int& height) {
+    if (maxWidth <= 0 || maxHeight <= 0 || (sourceWidth <= maxWidth && sourceHeight <= maxHeight)) {
+        width = sourceWidth;
+        height = sourceHeight;
+        return;
+    }
+    double scale = std::min(static_cast<double>(maxWidth) / sourceWidth, 
+                            static_cast<double>(maxHeight) / sourceHeight);
+    width = std::max(1, static_cast<int>(std::lround(sourceWidth * scale)));
+    height = std::max(1, static_cast<int>(std::lround(sourceHeight * scale)));
+}
+
+bool isJpegPath(const std::string& path) {
+    std::string extension = fs::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".jpg" || extension == ".jpeg";
+}
+
+#ifdef THD_WITH_LIBJPEG
+struct JpegErrorManager {
+    jpeg_error_mgr base;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+void jpegErrorExit(j_common_ptr info) {
+    JpegErrorManager* manager = reinterpret_cast<JpegErrorManager*>(info->err);
+    (*info->err->format_message)(info, manager->message);
+    std::longjmp(manager->jump, 1);
+}
+
+// Opens the file behind a source whose bytes are not in memory. Returns nullptr
+// for an in-memory source, or on failure with `error` set.
+FILE* openJpegFile(const ImageSource& source, std::string& error) {
+    FILE* file = source.bytes ? nullptr : std::fopen(source.path.c_str(), "rb");
+    if (!source.bytes && !file) {
+        error = std::strerror(errno);
+    }
+    return file;
+}
+
+void setJpegSource(jpeg_decompress_struct& info, const ImageSource& source, FILE* file) {
+    if (file) {
+        jpeg_stdio_src(&info, file);
+    } else {
+        jpeg_mem_src(&info, const_cast<unsigned char*>(source.bytes->data()), source.bytes->size());
+    }
+}
+
+void closeJpegFile(FILE* file) {
+    if (file) {
+        std::fclose(file);
+    }
+}
+
+// Smallest of the 1/2, 1/4 and 1/8 IDCT scales whose output still covers the
+// image fitted within maxWidth x maxHeight (1 when no limit is given)
+unsigned int jpegScaleDenominator(const jpeg_decompress_struct& info, int maxWidth, int maxHeight) {
+    if (maxWidth <= 0 || maxHeight <= 0) {
+        return 1;
+    }
+    int fitWidth = 0;
+    int fitHeight = 0;
+    fitWithin(info.image_width, info.image_height, maxWidth, maxHeight, fitWidth, fitHeight);
+    for (unsigned int candidate : {8u, 4u, 2u}) {
+        if ((info.image_width + candidate - 1) / candidate >= static_cast<unsigned int>(fitWidth) &&
+            (info.image_height + candidate - 1) / candidate >= static_cast<unsigned int>(fitHeight)) {
+            return candidate;
+        }
+    }
+    return 1;
+}
+
+// What a scaled JPEG decode did
+struct JpegScale {
+    int imageWidth = 0;   // Full resolution size of the image
+    int imageHeight = 0;
+    bool reduced = false; // Decoded below 1/1
+};
+
+// Decodes a JPEG to RGB24 using libjpeg's scaled IDCT. The smallest of the 1/2,
+// 1/4 and 1/8 scales whose output still covers the image fitted within
+// maxWidth x maxHeight is used; a max size of 0 decodes at full resolution.
+// `scale` reports the image's full size and whether a scale below 1/1 was used.
+SDL_Surface* loadJpegScaled(const ImageSource& source, int maxWidth, int maxHeight, JpegScale& scale, std::string& error) {
+    TraceScope span("jpeg decode");
+    FILE* file = openJpegFile(source, error);
+    if (!file && !source.bytes) {
+        return nullptr;
+    }
+    
+    jpeg_decompress_struct info;
+    JpegErrorManager errors;
+    SDL_Surface* volatile surface = nullptr;
+    info.err = jpeg_std_error(&errors.base);
+    errors.base.error_exit = jpegErrorExit;
+    if (setjmp(errors.jump)) {
+        error = errors.message;
+        jpeg_destroy_decompress(&info);
+        closeJpegFile(file);
+        SDL_FreeSurface(surface);
+        return nullptr;
+    }
+    
+    jpeg_create_decompress(&info);
+    setJpegSource(info, source, file);
+    jpeg_read_header(&info, TRUE);
+    if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK) {
+        error = "CMYK JPEG";
+        jpeg_destroy_decompress(&info);
+        closeJpegFile(file);
+        return nullptr;
+    }
+    
+    unsigned int denominator = jpegScaleDenominator(info, maxWidth, maxHeight);
+    info.scale_num = 1;
+    info.scale_denom = denominator;
+    info.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&info);
+    
+    surface = SDL_CreateRGBSurfaceWithFormat(0, info.output_width, info.output_height, 24, SDL_PIXELFORMAT_RGB24);
+    if (!surface) {
+        error = SDL_GetError();
+        jpeg_destroy_decompress(&info);
+        closeJpegFile(file);
+        return nullptr;
+    }
+    
+    Uint8* pixels = static_cast<Uint8*>(surface->pixels);
+    while (info.output_scanline < info.output_height) {
+        JSAMPROW rows[16];
+        JDIMENSION count = std::min<JDIMENSION>(16, info.output_height - info.output_scanline);
+        for (JDIMENSION i = 0; i < count; ++i) {
+            rows[i] = pixels + static_cast<size_t>(info.output_scanline + i) * surface->pitch;
+        }
+        jpeg_read_scanlines(&info, rows, count);
+    }
+    scale.imageWidth = static_cast<int>(info.image_width);
+    scale.imageHeight = static_cast<int>(info.image_height);
+    scale.reduced = denominator > 1;
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    closeJpegFile(file);
+    return surface;
+}
+
+#if JPEG_LIB_VERSION >= 70
+#define THD_DCT_H_SCALED_SIZE(component) ((component)->DCT_h_scaled_size)
+#define THD_DCT_V_SCALED_SIZE(component) ((component)->DCT_v_scaled_size)
+#define THD_MIN_DCT_V_SCALED_SIZE(info) ((info).min_DCT_v_scaled_size)
+#else
+#define THD_DCT_H_SCALED_SIZE(component) ((component)->DCT_scaled_size)
+#define THD_DCT_V_SCALED_SIZE(component) ((component)->DCT_scaled_size)
+#define THD_MIN_DCT_V_SCALED_SIZE(info) ((info).min_DCT_scaled_size)
+#endif
+
+// Box-filters one decoded JPEG component (rows from libjpeg) onto a plane of a
+// different size; used when the JPEG is not 4:2:0 to begin with
+void resampleComponent(JSAMPARRAY rows, int sourceWidth, int sourceHeight, const PixelPlane& target) {
+    for (int y = 0; y < target.height; ++y) {
+        int y0 = y * sourceHeight / target.height;
+        int y1 = std::max(y0 + 1, (y + 1) * sourceHeight / target.height);
+        Uint8* out = target.pixels + static_cast<size_t>(y) * target.pitch;
+        for (int x = 0; x < target.width; ++x) {
+            int x0 = x * sourceWidth / target.width;
+            int x1 = std::max(x0 + 1, (x + 1) * sourceWidth / target.width);
+            unsigned int sum = 0;
+            for (int sy = y0; sy < y1; ++sy) {
+                for (int sx = x0; sx < x1; ++sx) {
+                    sum += rows[sy][sx];
+                }
+            }
+            unsigned int count = static_cast<unsigned int>((y1 - y0) * (x1 - x0));
+            out[x] = static_cast<Uint8>((sum + count / 2) / count);
+        }
+    }
+}
+
+// Decodes a JPEG straight to planar YUV 4:2:0 with jpeg_read_raw_data, skipping
+// libjpeg's upsampling and colour conversion. Uses the same IDCT scale choice as
+// loadJpegScaled. Components with other subsampling are box-filtered to 4:2:0
+// and greyscale JPEGs get neutral chroma. Returns nullptr for RGB/CMYK JPEGs;
+// the caller owns the returned frame.
+YuvFrame* loadJpegYuv(const ImageSource& source, int maxWidth, int maxHeight, JpegScale& scale, std::string& error) {
+    TraceScope span("jpeg decode");
+    FILE* file = openJpegFile(source, error);
+    if (!file && !source.bytes) {
+        return nullptr;
+    }
+    
+    // Only POD locals live across setjmp; buffers come from libjpeg's pool
+    jpeg_decompress_struct info;
+    JpegErrorManager errors;
+    YuvFrame* volatile frame = nullptr;
+    info.err = jpeg_std_error(&errors.base);
+    errors.base.error_exit = jpegErrorExit;
+    if (setjmp(errors.jump)) {
+        error = errors.message;
+        jpeg_destroy_decompress(&info);
+        closeJpegFile(file);
+        delete frame;
+        return nullptr;
+    }
+    
+    jpeg_create_decompress(&info);
+    setJpegSource(info, source, file);
+    jpeg_read_header(&info, TRUE);
+    if (info.jpeg_color_space != JCS_YCbCr && info.jpeg_color_space != JCS_GRAYSCALE) {
+        error = "JPEG is not YCbCr";
+        jpeg_destroy_decompress(&info);
+        closeJpegFile(file);
+        return nullptr;
+    }
+    
+    unsigned int denominator = jpegScaleDenominator(info, maxWidth, maxHeight);
+    info.scale_num = 1;
+    info.scale_denom = denominator;
+    info.raw_data_out = TRUE;
+    info.out_color_space = info.jpeg_color_space;
+    jpeg_start_decompress(&info);
+    
+    int components = std::min(info.num_components, 3);
+    int linesPerPass = info.max_v_samp_factor * THD_MIN_DCT_V_SCALED_SIZE(info);
+    int passes = (static_cast<int>(info.output_height) + linesPerPass - 1) / linesPerPass;
+    JSAMPARRAY planes[3] = {};
+    int rowsPerPass[3] = {};
+    for (int c = 0; c < components; ++c) {
+        jpeg_component_info* component = &info.comp_info[c];
+        rowsPerPass[c] = component->v_samp_factor * THD_DCT_V_SCALED_SIZE(component);
+        JDIMENSION width = component->width_in_blocks * THD_DCT_H_SCALED_SIZE(component);
+        planes[c] = (*info.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&info), JPOOL_IMAGE,
+                                              width, rowsPerPass[c] * passes);
+    }
+    
+    for (int pass = 0; info.output_scanline < info.output_height; ++pass) {
+        JSAMPARRAY passRows[3] = {};
+        for (int c = 0; c < components; ++c) {
+            passRows[c] = planes[c] + pass * rowsPerPass[c];
+        }
+        jpeg_read_raw_data(&info, passRows, linesPerPass);
+    }
+    
+    frame = new YuvFrame(info.output_width, info.output_height);
+    for (int c = 0; c < 3; ++c) {
+        PixelPlane target = frame->plane(c);
+        if (c >= components) {
+            std::memset(target.pixels, 128, static_cast<size_t>(target.pitch) * target.height);
+            continue;
+        }
+        jpeg_component_info* component = &info.comp_info[c];
+        int width = static_cast<int>(component->downsampled_width);
+        int height = static_cast<int>(component->downsampled_height);
+        if (width == target.width && height == target.height) {
+            for (int y = 0; y < height; ++y) {
+                std::memcpy(target.pixels + static_cast<size_t>(y) * target.pitch, planes[c][y], width);
+            }
+        } else {
+            resampleComponent(planes[c], width, height, target);
+        }
+    }
+    
+    scale.imageWidth = static_cast<int>(info.image_width);
+    scale.imageHeight = static_cast<int>(info.image_height);
+    scale.reduced = denominator > 1;
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    closeJpegFile(file);
+    return frame;
+}
+#endif
+
+// Area-averaging downscaler for 8-bit-per-channel planes. Each output
+// pixel is the coverage-weighted mean of the source pixels under it, using 14-bit
+// fixed point weights. The vertical pass runs over whole contiguous rows so the
+// compiler vectorizes it; output rows are split into bands across threads.
+class Resampler {
+private:
+    static constexpr int weightBits = 14;
+    static constexpr int carryBits = 6;     // Precision kept between the two passes
+    
+    struct Taps {
+        int first = 0;
+        std::vector<uint32_t> weights;
+    };
+    
+    // Source coverage of each output coordinate when scaling `source` to `target`
+    static std::vector<Taps> computeTaps(int source, int target) {
+        std::vector<Taps> taps(target);
+        double scale = static_cast<double>(source) / target;
+        for (int i = 0; i < target; ++i) {
+            double start = i * scale;
+            double end = std::min<double>(source, (i + 1) * scale);
+            int first = static_cast<int>(start);
+            int last = std::min(source - 1, static_cast<int>(std::ceil(end)) - 1);
+            
+            Taps& tap = taps[i];
+            tap.first = first;
+            uint32_t total = 0;
+            size_t largest = 0;
+            for (int k = first; k <= last; ++k) {
+                double coverage = std::min<double>(k + 1, end) - std::max<double>(k, start);
+                uint32_t weight = static_cast<uint32_t>(std::lround(coverage / scale * (1 << weightBits)));
+                tap.weights.push_back(weight);
+                total += weight;
+                if (weight > tap.weights[largest]) {
+                    largest = tap.weights.size() - 1;
+                }
+            }
+            // Make the weights sum to exactly one so flat areas stay flat
+            tap.weights[largest] += (1u << weightBits) - total;
+        }
+        return taps;
+    }
+    
+    template <int Channels>
+    static void resampleRows(const PixelPlane& source, const PixelPlane& target, 
+                             const std::vector<Taps>& columns, const std::vector<Taps>& rows,
+                             int firstRow, int lastRow) {
+        size_t rowBytes = static_cast<size_t>(source.width) * Channels;
+        std::vector<uint32_t> accumulator(rowBytes);
+        std::vector<uint32_t> carried(rowBytes);
+        
+        for (int y = firstRow; y < lastRow; ++y) {
+            // Vertical pass: weighted sum of the source rows under this output row
+            std::fill(accumulator.begin(), accumulator.end(), 0);
+            const Taps& rowTaps = rows[y];
+            for (size_t k = 0; k < rowTaps.weights.size(); ++k) {
+                const Uint8* in = source.pixels + static_cast<size_t>(rowTaps.first + k) * source.pitch;
+                uint32_t weight = rowTaps.weights[k];
+                uint32_t* acc = accumulator.data();
+                for (size_t i = 0; i < rowBytes; ++i) {
+                    acc[i] += weight * in[i];
+                }
+            }
+            for (size_t i = 0; i < rowBytes; ++i) {
+                carried[i] = (accumulator[i] + (1u << (carryBits - 1))) >> carryBits;
+            }
+            
+            // Horizontal pass over the reduced row
+            Uint8* out = target.pixels + static_cast<size_t>(y) * target.pitch;
+            constexpr int shift = 2 * weightBits - carryBits;
+            for (int x = 0; x < target.width; ++x) {
+                const Taps& columnTaps = columns[x];
+                uint32_t sum[Channels] = {};
+                const uint32_t* in = carried.data() + static_cast<size_t>(columnTaps.first) * Channels;
+                for (size_t k = 0; k < columnTaps.weights.size(); ++k) {
+                    uint32_t weight = columnTaps.weights[k];
+                    for (int c = 0; c < Channels; ++c) {
+                        sum[c] += weight * in[k * Channels + c];
+                    }
+                }
+                for (int c = 0; c < Channels; ++c) {
+                    out[x * Channels + c] = static_cast<Uint8>(std::min<uint32_t>(255, (sum[c] + (1u << (shift - 1))) >> shift));
+                }
+            }
+        }
+    }
+
+public:
+    // Resamples `source` into `target` (1, 3 or 4 interleaved channels), splitting
+    // the output rows across the shared helper threads
+    static void resamplePlane(const PixelPlane& source, const PixelPlane& target, int channels, size_t threads) {
+        std::vector<Taps> columns = computeTaps(source.width, target.width);
+        std::vector<Taps> rows = computeTaps(source.height, target.height);
+        auto band = [&](int firstRow, int lastRow) {
+            if (channels == 4) {
+                resampleRows<4>(source, target, columns, rows, firstRow, lastRow);
+            } else if (channels == 3) {
+                resampleRows<3>(source, target, columns, rows, firstRow, lastRow);
+            } else {
+                resampleRows<1>(source, target, columns, rows, firstRow, lastRow);
+            }
+        };
+        
+        int height = target.height;
+        threads = std::clamp<size_t>(threads, 1, static_cast<size_t>(height));
+        int rowsPerBand = static_cast<int>((height + threads - 1) / threads);
+        HelperPool::shared().run(threads, [&](size_t t) {
+            int first = static_cast<int>(t) * rowsPerBand;
+            band(first, std::min(height, first + rowsPerBand));
+        });
+    }
+    
+    // Returns a new surface of width x height in the same pixel format (formats
+    // other than 24/32-bit packed are converted to ARGB8888 first)
+    static SDL_Surface* resample(SDL_Surface* source, int width, int height, size_t threads, std::string& error) {
+        TraceScope span("resize");
+        SDL_Surface* converted = nullptr;
+        int bytesPerPixel = SDL_BYTESPERPIXEL(source->format->format);
+        if (SDL_ISPIXELFORMAT_INDEXED(source->format->format) || (bytesPerPixel != 3 && bytesPerPixel != 4)) {
+            converted = SDL_ConvertSurfaceFormat(source, SDL_PIXELFORMAT_ARGB8888, 0);
+            if (!converted) {
+                error = SDL_GetError();
+                return nullptr;
+            }
+            source = converted;
+            bytesPerPixel = 4;
+        }
+        
+        SDL_Surface* target = SDL_CreateRGBSurfaceWithFormat(0, width, height, 
+                                                             SDL_BITSPERPIXEL(source->format->format), 
+                                                             source->format->format);
+        if (!target) {
+            error = SDL_GetError();
+            SDL_FreeSurface(converted);
+            return nullptr;
+        }
+        
+        resamplePlane({static_cast<Uint8*>(source->pixels), source->w, source->h, source->pitch},
+                      {static_cast<Uint8*>(target->pixels), target->w, target->h, target->pitch},
+                      bytesPerPixel, threads);
+        SDL_FreeSurface(converted);
+        return target;
+    }
+    
+    static std::unique_ptr<YuvFrame> resample(YuvFrame& source, int width, int height, size_t threads) {
+        TraceScope span("resize");
+        auto target = std::make_unique<YuvFrame>(width, height);
+        for (int plane = 0; plane < 3; ++plane) {
+            resamplePlane(source.plane(plane), target->plane(plane), 1, threads);
+        }
+        return target;
+    }
+};
+
+// Where each of R, G, B and A sits within a pixel of an 8-bit-per-channel RGB
+// format, as a byte offset (-1 if the format lacks the channel). Packed formats
+// are read through their masks, which relies on a little-endian host.
+struct ChannelLayout {
+    int bytes = 0;
+    int offset[4] = {-1, -1, -1, -1};
+};
+
+bool channelLayout(Uint32 format, ChannelLayout& layout) {
+    if (format == SDL_PIXELFORMAT_RGB24 || format == SDL_PIXELFORMAT_BGR24) {
+        bool rgb = format == SDL_PIXELFORMAT_RGB24;
+        layout.bytes = 3;
+        layout.offset[0] = rgb ? 0 : 2;
+        layout.offset[1] = 1;
+        layout.offset[2] = rgb ? 2 : 0;
+        layout.offset[3] = -1;
+        return true;
+    }
+    if (SDL_ISPIXELFORMAT_FOURCC(format) || SDL_ISPIXELFORMAT_INDEXED(format) || 
+        SDL_PIXELLAYOUT(format) != SDL_PACKEDLAYOUT_8888) {
+        return false;
+    }
+    int bitsPerPixel = 0;
+    Uint32 masks[4] = {};
+    if (!SDL_PixelFormatEnumToMasks(format, &bitsPerPixel, &masks[0], &masks[1], &masks[2], &masks[3])) {
+        return false;
+    }
+    layout.bytes = 4;
+    for (int c = 0; c < 4; ++c) {
+        layout.offset[c] = -1;
+        for (int b = 0; b < 4; ++b) {
+            if (masks[c] == 0xFFu << (8 * b)) {
+                layout.offset[c] = b;
+            }
+        }
+    }
+    return layout.offset[0] >= 0 && layout.offset[1] >= 0 && layout.offset[2] >= 0;
+}
+
+// Converts between 8-bit-per-channel RGB formats by shuffling bytes. Target
+// bytes with no source channel (missing alpha, padding) are set to 0xFF. With
+// SSSE3 enabled at build time (-mssse3 or -march=native) four pixels go
+// through one pshufb; the scalar loop handles the rest.
+class PixelConverter {
+private:
+    int sourceBytes = 0;
+    int targetBytes = 0;
+    int sourceByte[4] = {};  // Per target byte: source byte offset, or -1 for 0xFF
+    bool usable = false;
+#ifdef __SSSE3__
+    __m128i shuffle;
+    __m128i fill;
+#endif
+
+public:
+    PixelConverter(Uint32 source, Uint32 target) {
+        ChannelLayout from;
+        ChannelLayout to;
+        if (!channelLayout(source, from) || !channelLayout(target, to)) {
+            return;
+        }
+        sourceBytes = from.bytes;
+        targetBytes = to.bytes;
+        for (int b = 0; b < 4; ++b) {
+            sourceByte[b] = -1;
+        }
+        for (int c = 0; c < 4; ++c) {
+            if (to.offset[c] >= 0) {
+                sourceByte[to.offset[c]] = from.offset[c];
+            }
+        }
+        usable = true;
+        
+#ifdef __SSSE3__
+        alignas(16) Uint8 shuffleBytes[16];
+        alignas(16) Uint8 fillBytes[16];
+        for (int p = 0; p < 4; ++p) {
+            for (int b = 0; b < 4; ++b) {
+                bool filled = sourceByte[b] < 0;
+                shuffleBytes[p * 4 + b] = filled ? 0x80 : static_cast<Uint8>(p * sourceBytes + sourceByte[b]);
+                fillBytes[p * 4 + b] = filled ? 0xFF : 0x00;
+            }
+        }
+        shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(shuffleBytes));
+        fill = _mm_load_si128(reinterpret_cast<const __m128i*>(fillBytes));
+#endif
+    }
+    
+    bool valid() const {
+        return usable;
+    }
+    
+    void convertRow(const Uint8* source, Uint8* target, int width) const {
+        size_t x = 0;
+        size_t count = static_cast<size_t>(width);
+#ifdef __SSSE3__
+        // Each load reads 16 bytes, so stop while a full vector is still in the row
+        if (targetBytes == 4) {
+            for (; x * sourceBytes + 16 <= count * sourceBytes; x += 4) {
+                __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x * sourceBytes));
+                pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), fill);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(target + x * 4), pixels);
+            }
+        }
+#endif
+        for (; x < count; ++x) {
+            const Uint8* in = source + x * sourceBytes;
+            Uint8* out = target + x * targetBytes;
+            for (int b = 0; b < targetBytes; ++b) {
+                out[b] = sourceByte[b] >= 0 ? in[sourceByte[b]] : 0xFF;
+            }
+        }
+    }
+};
+
+// Returns the surface in `format`, taking ownership of the original
+SDL_Surface* convertSurface(SDL_Surface* surface, Uint32 format, std::string& error) {
+    if (!surface || surface->format->format == format) {
+        return surface;
+    }
+    
+    TraceScope span("convert");
+    PixelConverter converter(surface->format->format, format);
+    SDL_Surface* converted = converter.valid()
+        ? SDL_CreateRGBSurfaceWithFormat(0, surface->w, surface->h, SDL_BITSPERPIXEL(format), format)
+        : SDL_ConvertSurfaceFormat(surface, format, 0);
+    if (converted && converter.valid()) {
+        for (int y = 0; y < surface->h; ++y) {
+            converter.convertRow(static_cast<const Uint8*>(surface->pixels) + static_cast<size_t>(y) * surface->pitch,
+                                 static_cast<Uint8*>(converted->pixels) + static_cast<size_t>(y) * converted->pitch,
+                                 surface->w);
+        }
+    }
+    if (!converted) {
+        error = SDL_GetError();
+    }
+    SDL_FreeSurface(surface);
+    return converted;
+}
+
+// Texture format for decoded frames: the first format the renderer lists that
+// PixelConverter can write, so uploads need no conversion in the driver
+Uint32 preferredTextureFormat(const SDL_RendererInfo& info, Uint32 fallback) {
+    for (Uint32 i = 0; i < info.num_texture_formats; ++i) {
+        ChannelLayout layout;
+        if (channelLayout(info.texture_formats[i], layout) && layout.bytes == 4) {
+            return info.texture_formats[i];
+        }
+    }
+    return fallback;
+}
+
+// Largest rect with the image's aspect ratio that fits the window, centered
+SDL_Rect aspectFit(int imageWidth, int imageHeight, int windowWidth, int windowHeight) {
+    float scaleX = static_cast<float>(windowWidth) / imageWidth;
+    float scaleY = static_cast<float>(windowHeight) / imageHeight;
+    float scale = std::min(scaleX, scaleY);
+    
+    int renderWidth = static_cast<int>(imageWidth * scale);
+    int renderHeight = static_cast<int>(imageHeight * scale);
+    return {(windowWidth - renderWidth) / 2, (windowHeight - renderHeight) / 2, renderWidth, renderHeight};
+}
+
+uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+// Latency histogram with HDR-style log-linear buckets: every power of two of
+// nanoseconds is split into 32 linear steps, so recording is a few
+// instructions with no allocation and percentiles are exact to about 3%
+class LatencyHistogram {
+private:
+    static constexpr int subBucketBits = 5;
+    static constexpr uint64_t subBuckets = 1u << subBucketBits;
+    static constexpr size_t bucketCount = subBuckets + (64 - subBucketBits) * subBuckets;
+    
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sumNs = 0;
+    uint64_t maxNs = 0;
+    
+    static size_t bucketOf(uint64_t ns) {
+        if (ns < subBuckets) {
+            return static_cast<size_t>(ns);
+        }
+        int top = 63 - __builtin_clzll(ns);
+        int shift = top - subBucketBits;
+        return subBuckets + static_cast<size_t>(shift) * subBuckets + ((ns >> shift) - subBuckets);
+    }
+    
+    // Largest value that lands in the bucket
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < subBuckets) {
+            return bucket;
+        }
+        int shift = static_cast<int>((bucket - subBuckets) / subBuckets);
+        uint64_t step = (bucket - subBuckets) % subBuckets;
+        return ((subBuckets + step + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(bucketCount, 0) {}
+    
+    void record(uint64_t ns) {
+        counts[bucketOf(ns)]++;
+        total++;
+        sumNs += ns;
+        maxNs = std::max(maxNs, ns);
+    }
+    
+    void recordMs(double ms) {
+        record(static_cast<uint64_t>(std::max(0.0, ms) * 1e6));
+    }
+    
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < bucketCount; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sumNs += other.sumNs;
+        maxNs = std::max(maxNs, other.maxNs);
+    }
+    
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = sumNs = maxNs = 0;
+    }
+    
+    uint64_t count() const {
+        return total;
+    }
+    
+    uint64_t maxValue() const {
+        return maxNs;
+    }
+    
+    double mean() const {
+        return total ? static_cast<double>(sumNs) / total : 0.0;
+    }
+    
+    // Value below which `percent` of the samples fall, in nanoseconds
+    uint64_t percentile(double percent) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percent / 100.0 * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucketLimit(i), maxNs);
+            }
+        }
+        return maxNs;
+    }
+    
+    // {"count": n, "mean_us": ..., "p50_us": ..., "p90_us": ..., "p99_us": ..., "max_us": ...}
+    void writeJson(std::ostream& out) const {
+        out << "{\"count\": " << total 
+            << ", \"mean_us\": " << mean() / 1000.0
+            << ", \"p50_us\": " << percentile(50) / 1000.0
+            << ", \"p90_us\": " << percentile(90) / 1000.0
+            << ", \"p99_us\": " << percentile(99) / 1000.0
+            << ", \"max_us\": " << maxNs / 1000.0 << "}";
+    }
+    
+    // name,count,mean_us,p50_us,p90_us,p99_us,max_us
+    void writeCsvRow(std::ostream& out, const std::string& name) const {
+        out << name << "," << total << "," << mean() / 1000.0 << "," << percentile(50) / 1000.0 << "," 
+            << percentile(90) / 1000.0 << "," << percentile(99) / 1000.0 << "," << maxNs / 1000.0 << std::endl;
+    }
+};
+
+struct UploadStats {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+};
+
+// Copies pixels into a streaming texture through SDL_LockTexture, converting
+// the pixel format on the way when the source differs from the texture
+bool writeStreamingTexture(SDL_Texture* texture, Uint32 textureFormat, int width, int height,
+                           Uint32 sourceFormat, const void* pixels, int pitch, UploadStats& stats) {
+    void* locked = nullptr;
+    int lockedPitch = 0;
+    if (SDL_LockTexture(texture, nullptr, &locked, &lockedPitch) != 0) {
+        return false;
+    }
+    
+    size_t rowBytes = static_cast<size_t>(width) * SDL_BYTESPERPIXEL(textureFormat);
+    bool ok = true;
+    if (sourceFormat != textureFormat) {
+        ok = SDL_ConvertPixels(width, height, sourceFormat, pixels, pitch, textureFormat, locked, lockedPitch) == 0;
+    } else if (pitch == lockedPitch && static_cast<size_t>(pitch) == rowBytes) {
+        std::memcpy(locked, pixels, rowBytes * height);
+    } else {
+        for (int y = 0; y < height; ++y) {
+            std::memcpy(static_cast<Uint8*>(locked) + static_cast<size_t>(y) * lockedPitch,
+                        static_cast<const Uint8*>(pixels) + static_cast<size_t>(y) * pitch, rowBytes);
+        }
+    }
+    SDL_UnlockTexture(texture);
+    
+    if (ok) {
+        stats.frames++;
+        stats.bytes += rowBytes * height;
+    }
+    return ok;
+}
+
+// Uploads the three planes of a YUV frame; the renderer converts to RGB on the GPU
+bool writeYuvTexture(SDL_Texture* texture, YuvFrame& frame, UploadStats& stats) {
+    PixelPlane y = frame.plane(0);
+    PixelPlane u = frame.plane(1);
+    PixelPlane v = frame.plane(2);
+    if (SDL_UpdateYUVTexture(texture, nullptr, y.pixels, y.pitch, u.pixels, u.pitch, v.pixels, v.pitch) != 0) {
+        return false;
+    }
+    stats.frames++;
+    stats.bytes += frame.pixels.size();
+    return true;
+}
+
+// A few streaming textures written in rotation, so a new frame never goes into
+// the texture the GPU may still be drawing the previous frame from
+class StreamingRing {
+private:
+    struct Slot {
+        SDL_Texture* texture = nullptr;
+        Uint32 format = SDL_PIXELFORMAT_UNKNOWN;
+        int width = 0;
+        int height = 0;
+    };
+    
+    SDL_Renderer* renderer = nullptr;
+    std::vector<Slot> slots;
+    size_t next = 0;
+    UploadStats stats;
+    LatencyHistogram latency;
+    
+    // Texture of the next slot, recreated if the frame format or size changed
+    SDL_Texture* nextTexture(Uint32 format, int width, int height) {
+        Slot& slot = slots[next];
+        next = (next + 1) % slots.size();
+        
+        if (!slot.texture || slot.format != format || slot.width != width || slot.height != height) {
+            if (slot.texture) {
+                SDL_DestroyTexture(slot.texture);
+            }
+            slot = Slot();
+            slot.texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, width, height);
+            if (!slot.texture) {
+                return nullptr;
+            }
+            slot.format = format;
+            slot.width = width;
+            slot.height = height;
+        }
+        return slot.texture;
+    }
+
+public:
+    StreamingRing() = default;
+    StreamingRing(const StreamingRing&) = delete;
+    StreamingRing& operator=(const StreamingRing&) = delete;
+    
+    ~StreamingRing() {
+        clear();
+    }
+    
+    void reset(SDL_Renderer* targetRenderer, size_t slotCount) {
+        clear();
+        renderer = targetRenderer;
+        slots.assign(std::max<size_t>(1, slotCount), Slot());
+        next = 0;
+    }
+    
+    void clear() {
+        for (auto& slot : slots) {
+            if (slot.texture) {
+                SDL_DestroyTexture(slot.texture);
+            }
+            slot = Slot();
+        }
+    }
+    
+    // Writes a frame into the next slot, recreating it if the frame size changed
+    SDL_Texture* upload(Uint32 format, int width, int height, const void* pixels, int pitch) {
+        TraceScope span("upload");
+        auto start = std::chrono::steady_clock::now();
+        SDL_Texture* texture = nextTexture(format, width, height);
+        if (!texture || !writeStreamingTexture(texture, format, width, height, format, pixels, pitch, stats)) {
+            return nullptr;
+        }
+        latency.record(nanosecondsSince(start));
+        return texture;
+    }
+    
+    // Writes Y, U and V planes into the next slot as an IYUV texture
+    SDL_Texture* uploadYuv(int width, int height, const PixelPlane (&planes)[3]) {
+        TraceScope span("upload");
+        auto start = std::chrono::steady_clock::now();
+        SDL_Texture* texture = nextTexture(SDL_PIXELFORMAT_IYUV, width, height);
+        if (!texture || SDL_UpdateYUVTexture(texture, nullptr, planes[0].pixels, planes[0].pitch, planes[1].pixels, 
+                                             planes[1].pitch, planes[2].pixels, planes[2].pitch) != 0) {
+            return nullptr;
+        }
+        stats.frames++;
+        for (const PixelPlane& plane : planes) {
+            stats.bytes += static_cast<uint64_t>(plane.width) * plane.height;
+        }
+        latency.record(nanosecondsSince(start));
+        return texture;
+    }
+    
+    const UploadStats& uploadStats() const {
+        return stats;
+    }
+    
+    const LatencyHistogram& uploadLatency() const {
+        return latency;
+    }
+};
+
+// Sum of absolute differences between two byte ranges
+uint64_t sumAbsDifference(const Uint8* a, const Uint8* b, size_t bytes) {
+    uint64_t total = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i sum = _mm_setzero_si128();
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(x, y));
+    }
+    uint64_t halves[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(halves), sum);
+    total = halves[0] + halves[1];
+#endif
+    for (; i < bytes; ++i) {
+        total += static_cast<uint64_t>(std::abs(a[i] - b[i]));
+    }
+    return total;
+}
+
+// Decoded frames stored as a keyframe every `interval` frames and, in between,
+// only the tiles that changed since the previous frame. Playing forward applies
+// one frame's tiles to a working copy and uploads just the rows they cover; a
+// seek rebuilds the working copy from the nearest earlier keyframe, so random
+// access costs at most `interval` deltas. With a tolerance, tiles that differ
+// from the previous frame by at most that many levels on average are not
+// stored; the comparison is against the frame as playback will rebuild it, so
+// the error never builds up. Frames are appended in order; all must share one
+// size and format. Render thread only.
+class DeltaFrameStore {
+public:
+    static constexpr int tileSize = 32;
+
+private:
+    struct Frame {
+        bool keyframe = false;
+        std::vector<uint32_t> tiles;   // Changed tiles, numbered row by row
+        std::vector<Uint8> pixels;     // Whole frame, or the changed tiles one after another
+    };
+    
+    SDL_Renderer* renderer;
+    size_t interval;
+    int tolerance;
+    size_t budgetBytes;
+    size_t usedBytes = 0;
+    Uint32 format = SDL_PIXELFORMAT_UNKNOWN;
+    int width = 0;
+    int height = 0;
+    size_t pixelBytes = 0;
+    size_t rowBytes = 0;
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<Frame> frames;
+    size_t sinceKeyframe = 0;
+    std::vector<Uint8> previous;      // Last appended frame as playback rebuilds it
+    std::vector<Uint8> working;       // Frame shown by present()
+    size_t workingIndex = SIZE_MAX;
+    int dirtyTop = 0;                 // Rows of `working` not yet in the texture
+    int dirtyBottom = 0;
+    SDL_Texture* texture = nullptr;
+    UploadStats stats;
+    LatencyHistogram latency;
+    uint64_t storedTiles = 0;
+    uint64_t totalTiles = 0;
+    
+    SDL_Rect tileRect(uint32_t tile) const {
+        int x = static_cast<int>(tile % tilesX) * tileSize;
+        int y = static_cast<int>(tile / tilesX) * tileSize;
+        return {x, y, std::min(tileSize, width - x), std::min(tileSize, height - y)};
+    }
+    
+    static size_t frameBytes(const Frame& frame) {
+        return sizeof(Frame) + frame.pixels.size() + frame.tiles.size() * sizeof(uint32_t);
+    }
+    
+    // Applies frame `index` on top of its predecessor in `buffer`. Returns the
+    // rows it touched as [top, bottom).
+    void apply(size_t index, std::vector<Uint8>& buffer, int& top, int& bottom) const {
+        const Frame& frame = frames[index];
+        if (frame.keyframe) {
+            std::memcpy(buffer.data(), frame.pixels.data(), buffer.size());
+            top = 0;
+            bottom = height;
+            return;
+        }
+        const Uint8* source = frame.pixels.data();
+        for (uint32_t tile : frame.tiles) {
+            SDL_Rect rect = tileRect(tile);
+            size_t tileRowBytes = rect.w * pixelBytes;
+            for (int y = 0; y < rect.h; ++y) {
+                std::memcpy(buffer.data() + (rect.y + y) * rowBytes + rect.x * pixelBytes, source, tileRowBytes);
+                source += tileRowBytes;
+            }
+            top = std::min(top, rect.y);
+            bottom = std::max(bottom, rect.y + rect.h);
+        }
+    }
+    
+    // Rebuilds frame `index` in `buffer`, carrying on from `from` (the frame
+    // `buffer` holds now) when that is on the way from the keyframe. Returns
+    // false, leaving `buffer` alone, when no keyframe precedes it, as for
+    // placeholders ahead of the first readable frame.
+    bool rebuild(size_t index, std::vector<Uint8>& buffer, size_t from, int& top, int& bottom) const {
+        size_t key = index;
+        while (key > 0 && !frames[key].keyframe) {
+            key--;
+        }
+        if (!frames[key].keyframe) {
+            return false;
+        }
+        size_t start = from != SIZE_MAX && from >= key && from < index ? from + 1 : key;
+        for (size_t i = start; i <= index; ++i) {
+            apply(i, buffer, top, bottom);
+        }
+        return true;
+    }
+
+public:
+    DeltaFrameStore(SDL_Renderer* targetRenderer, size_t keyframeInterval, int tileTolerance, size_t budget)
+        : renderer(targetRenderer), interval(std::max<size_t>(1, keyframeInterval)), 
+          tolerance(std::max(0, tileTolerance)), budgetBytes(budget) {}
+    DeltaFrameStore(const DeltaFrameStore&) = delete;
+    DeltaFrameStore& operator=(const DeltaFrameStore&) = delete;
+    
+    ~DeltaFrameStore() {
+        if (texture) {
+            SDL_DestroyTexture(texture);
+        }
+    }
+    
+    // Appends the next frame. Returns false, storing nothing, when the budget is
+    // reached or the frame's size or format differs from the first frame's.
+    bool append(const SDL_Surface* surface) {
+        bool started = width != 0;
+        if (started && (surface->w != width || surface->h != height || surface->format->format != format)) {
+            return false;
+        }
+        if (!started) {
+            format = surface->format->format;
+            width = surface->w;
+            height = surface->h;
+            pixelBytes = SDL_BYTESPERPIXEL(format);
+            rowBytes = static_cast<size_t>(width) * pixelBytes;
+            tilesX = (width + tileSize - 1) / tileSize;
+            tilesY = (height + tileSize - 1) / tileSize;
+            previous.assign(rowBytes * height, 0);
+        }
+        const Uint8* pixels = static_cast<const Uint8*>(surface->pixels);
+        
+        Frame frame;
+        frame.keyframe = !started || sinceKeyframe + 1 >= interval;
+        if (frame.keyframe) {
+            if (usedBytes + sizeof(Frame) + previous.size() > budgetBytes) {
+                return false;
+            }
+            frame.pixels.resize(previous.size());
+            for (int y = 0; y < height; ++y) {
+                std::memcpy(frame.pixels.data() + y * rowBytes, pixels + static_cast<size_t>(y) * surface->pitch, rowBytes);
+            }
+            previous = frame.pixels;
+        } else {
+            // Find the changed tiles first so a frame over budget leaves `previous` alone
+            for (uint32_t tile = 0; tile < static_cast<uint32_t>(tilesX * tilesY); ++tile) {
+                SDL_Rect rect = tileRect(tile);
+                size_t tileRowBytes = rect.w * pixelBytes;
+                uint64_t limit = static_cast<uint64_t>(tolerance) * tileRowBytes * rect.h;
+                uint64_t difference = 0;
+                for (int y = 0; y < rect.h && difference <= limit; ++y) {
+                    const Uint8* now = pixels + static_cast<size_t>(rect.y + y) * surface->pitch + rect.x * pixelBytes;
+                    const Uint8* before = previous.data() + (rect.y + y) * rowBytes + rect.x * pixelBytes;
+                    difference += tolerance == 0 ? (std::memcmp(now, before, tileRowBytes) != 0)
+                                                 : sumAbsDifference(now, before, tileRowBytes);
+                }
+                if (difference > limit) {
+                    frame.tiles.push_back(tile);
+                    frame.pixels.resize(frame.pixels.size() + tileRowBytes * rect.h);
+                }
+            }
+            if (usedBytes + frameBytes(frame) > budgetBytes) {
+                return false;
+            }
+            Uint8* out = frame.pixels.data();
+            for (uint32_t tile : frame.tiles) {
+                SDL_Rect rect = tileRect(tile);
+                size_t tileRowBytes = rect.w * pixelBytes;
+                for (int y = 0; y < rect.h; ++y) {
+                    const Uint8* row = pixels + static_cast<size_t>(rect.y + y) * surface->pitch + rect.x * pixelBytes;
+                    std::memcpy(out, row, tileRowBytes);
+                    std::memcpy(previous.data() + (rect.y + y) * rowBytes + rect.x * pixelBytes, row, tileRowBytes);
+                    out += tileRowBytes;
+                }
+            }
+        }
+        
+        sinceKeyframe = frame.keyframe ? 0 : sinceKeyframe + 1;
+        storedTiles += frame.keyframe ? tilesX * tilesY : frame.tiles.size();
+        totalTiles += tilesX * tilesY;
+        usedBytes += frameBytes(frame);
+        frames.push_back(std::move(frame));
+        return true;
+    }
+    
+    // Appends a frame that could not be decoded; it repeats the frame before it
+    // and is never shown
+    void appendPlaceholder() {
+        frames.push_back(Frame());
+        usedBytes += sizeof(Frame);
+        sinceKeyframe++;
+    }
+    
+    // Drops the frames from `count` on, e.g. when a frame is inserted before them
+    void truncate(size_t count) {
+        if (count >= frames.size()) {
+            return;
+        }
+        for (size_t i = count; i < frames.size(); ++i) {
+            usedBytes -= frameBytes(frames[i]);
+        }
+        frames.resize(count);
+        if (workingIndex != SIZE_MAX && workingIndex >= count) {
+            workingIndex = SIZE_MAX;
+        }
+        
+        // Bring the builder's copy back to the new last frame
+        sinceKeyframe = 0;
+        while (sinceKeyframe < count && !frames[count - 1 - sinceKeyframe].keyframe) {
+            sinceKeyframe++;
+        }
+        if (sinceKeyframe == count) {
+            // No keyframe left, so the next append starts over and may bring a
+            // different size; nothing sized for the old frames can stay
+            width = 0;
+            previous.clear();
+            working.clear();
+            workingIndex = SIZE_MAX;
+            dirtyTop = 0;
+            dirtyBottom = 0;
+            if (texture) {
+                SDL_DestroyTexture(texture);
+                texture = nullptr;
+            }
+        } else {
+            int top = height;
+            int bottom = 0;
+            rebuild(count - 1, previous, SIZE_MAX, top, bottom);
+        }
+    }
+    
+    // Brings the texture up to frame `index` and returns it
+    SDL_Texture* present(size_t index) {
+        if (index >= frames.size() || width == 0) {
+            return nullptr;
+        }
+        TraceScope span("delta present", static_cast<int64_t>(index));
+        if (working.empty()) {
+            working.assign(rowBytes * height, 0);
+        }
+        if (index != workingIndex) {
+            if (!rebuild(index, working, workingIndex, dirtyTop, dirtyBottom)) {
+                return nullptr;
+            }
+            workingIndex = index;
+        }
+        
+        auto start = std::chrono::steady_clock::now();
+        if (!texture) {
+            texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, width, height);
+            if (!texture) {
+                return nullptr;
+            }
+            dirtyTop = 0;
+            dirtyBottom = height;
+        }
+        if (dirtyTop < dirtyBottom) {
+            SDL_Rect rows = {0, dirtyTop, width, dirtyBottom - dirtyTop};
+            void* locked = nullptr;
+            int lockedPitch = 0;
+            if (SDL_LockTexture(texture, &rows, &locked, &lockedPitch) != 0) {
+                return nullptr;
+            }
+            for (int y = 0; y < rows.h; ++y) {
+                std::memcpy(static_cast<Uint8*>(locked) + static_cast<size_t>(y) * lockedPitch,
+                            working.data() + (rows.y + y) * rowBytes, rowBytes);
+            }
+            SDL_UnlockTexture(texture);
+            stats.bytes += rowBytes * rows.h;
+        }
+        stats.frames++;
+        latency.record(nanosecondsSince(start));
+        dirtyTop = height;
+        dirtyBottom = 0;
+        return texture;
+    }
+    
+    size_t size() const {
+        return frames.size();
+    }
+    
+    size_t residentBytes() const {
+        return usedBytes;
+    }
+    
+    // Fraction of tiles stored, keyframes included
+    double storedFraction() const {
+        return totalTiles ? static_cast<double>(storedTiles) / totalTiles : 0.0;
+    }
+    
+    const UploadStats& uploadStats() const {
+        return stats;
+    }
+    
+    const LatencyHistogram& uploadLatency() const {
+        return latency;
+    }
+};
+
+// A frame N steps behind the playhead ranks like one N * behindWeight ahead
+static constexpr size_t behindWeight = 4;
+
+// Eviction distance of a frame from the playhead; "ahead" is in the play
+// direction (+1 forward, -1 backward) and the sequence wraps around
+size_t playheadDistance(size_t index, size_t playhead, size_t frameCount, int direction) {
+    size_t forward = (index + frameCount - playhead) % frameCount;
+    size_t backward = (playhead + frameCount - index) % frameCount;
+    if (direction < 0) {
+        std::swap(forward, backward);
+    }
+    return std::min(forward, backward * behindWeight);
+}
+
+// Texture cache holding a window of frames around the playhead within a memory
+// budget. Frames furthest from the playhead are evicted first, with frames behind
+// it counting as further away than frames ahead. An evicted texture of matching
+// size is reused for the incoming frame instead of being destroyed. Textures are
+// streaming textures filled through SDL_LockTexture; decoders already produce the
+// texture format, so filling one is a straight copy. A run of repeated frames
+// shares the texture of its first frame.
+class FrameCache {
+public:
+    static constexpr Uint32 defaultTextureFormat = SDL_PIXELFORMAT_ARGB8888;
+
+private:
+    struct Entry {
+        SDL_Texture* texture = nullptr;
+        Uint32 format = SDL_PIXELFORMAT_UNKNOWN;
+        int width = 0;
+        int height = 0;
+        size_t bytes = 0;
+        uint32_t generation = 0;
+        bool fullResolution = true;
+        SDL_BlendMode blendMode = SDL_BLENDMODE_NONE;
+    };
+    
+    SDL_Renderer* renderer = nullptr;
+    Uint32 textureFormat = defaultTextureFormat;
+    std::unordered_map<size_t, Entry> entries;
+    size_t frameCount = 0;
+    size_t budgetBytes = 0;
+    size_t usedBytes = 0;
+    size_t playhead = 0;
+    int direction = 1;
+    UploadStats stats;
+    LatencyHistogram latency;
+    std::unordered_map<size_t, size_t> sharedWith;  // Repeated frame -> first frame of its run
+    std::unordered_map<size_t, size_t> runEnds;     // First frame of a run -> its last frame
+    
+    // A shared texture is as near as the nearest frame showing it
+    size_t distance(size_t index) const {
+        auto run = runEnds.find(index);
+        if (run == runEnds.end()) {
+            return playheadDistance(index, playhead, frameCount, direction);
+        }
+        if (index <= playhead && playhead <= run->second) {
+            return 0;
+        }
+        return std::min(playheadDistance(index, playhead, frameCount, direction),
+                        playheadDistance(run->second, playhead, frameCount, direction));
+    }
+    
+    void destroy(Entry& entry) {
+        SDL_DestroyTexture(entry.texture);
+        usedBytes -= entry.bytes;
+        entry = Entry();
+    }
+    
+    std::unordered_map<size_t, Entry>::iterator farthest() {
+        auto victim = entries.end();
+        size_t victimDistance = 0;
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            size_t d = distance(it->first);
+            if (victim == entries.end() || d > victimDistance) {
+                victim = it;
+                victimDistance = d;
+            }
+        }
+        return victim;
+    }
+
+public:
+    FrameCache() = default;
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+    
+    ~FrameCache() {
+        clear();
+    }
+    
+    void reset(SDL_Renderer* targetRenderer, size_t frames, size_t budget) {
+        clear();
+        renderer = targetRenderer;
+        frameCount = frames;
+        budgetBytes = budget;
+        playhead = 0;
+        direction = 1;
+    }
+    
+    void clear() {
+        for (auto& item : entries) {
+            destroy(item.second);
+        }
+        entries.clear();
+    }
+    
+    // RGB frames are stored in this format; decoders should produce it already
+    void setTextureFormat(Uint32 format) {
+        clear();
+        textureFormat = format;
+    }
+    
+    Uint32 format() const {
+        return textureFormat;
+    }
+    
+    // Makes room for a frame inserted into the sequence at `position`; cached
+    // frames at or after it move up one index. Runs of repeated frames are
+    // forgotten until they are scanned again.
+    void insertFrame(size_t position) {
+        frameCount++;
+        if (position + 1 < frameCount) {
+            sharedWith.clear();
+            runEnds.clear();
+            std::unordered_map<size_t, Entry> shifted;
+            shifted.reserve(entries.size());
+            for (auto& item : entries) {
+                shifted.emplace(item.first >= position ? item.first + 1 : item.first, item.second);
+            }
+            entries.swap(shifted);
+            if (playhead >= position) {
+                playhead++;
+            }
+        }
+    }
+    
+    // "Ahead" means in the given play direction (+1 forward, -1 backward)
+    void setPlayhead(size_t index, int playDirection) {
+        playhead = index;
+        direction = playDirection;
+    }
+    
+    // Marks frame `index` as a repeat of `original`, the first frame of its run;
+    // both are shown with the original's texture from now on
+    void shareTexture(size_t index, size_t original) {
+        auto own = entries.find(index);
+        if (own != entries.end()) {
+            destroy(own->second);
+            entries.erase(own);
+        }
+        sharedWith[index] = original;
+        size_t& last = runEnds.emplace(original, original).first->second;
+        last = std::max(last, index);
+    }
+    
+    // The frame whose texture `index` is shown with
+    size_t canonical(size_t index) const {
+        auto it = sharedWith.find(index);
+        return it != sharedWith.end() ? it->second : index;
+    }
+    
+    // Last frame of the run that starts at `index`
+    size_t runEnd(size_t index) const {
+        auto it = runEnds.find(index);
+        return it != runEnds.end() ? it->second : index;
+    }
+    
+    size_t sharedFrames() const {
+        return sharedWith.size();
+    }
+    
+    SDL_Texture* find(size_t index) const {
+        auto it = entries.find(canonical(index));
+        return it != entries.end() ? it->second.texture : nullptr;
+    }
+    
+    // Display target generation the cached frame was sized for
+    uint32_t generationOf(size_t index) const {
+        auto it = entries.find(canonical(index));
+        return it != entries.end() ? it->second.generation : 0;
+    }
+    
+    bool isFullResolution(size_t index) const {
+        auto it = entries.find(canonical(index));
+        return it != entries.end() && it->second.fullResolution;
+    }
+    
+    // Uploads the surface as frame `index`. Returns nullptr if the cache is full of
+    // frames closer to the playhead; the frame at the playhead is always admitted.
+    // A cached frame is only replaced by one sized for a newer display target, or
+    // by a full resolution decode of a reduced-scale preview, and is kept if the
+    // replacement cannot be admitted or uploaded.
+    SDL_Texture* insert(size_t index, const DecodedFrame& frame) {
+        index = canonical(index);
+        Entry previous;
+        auto existing = entries.find(index);
+        if (existing != entries.end()) {
+            const Entry& cached = existing->second;
+            bool newer = cached.generation < frame.generation ||
+                         (cached.generation == frame.generation && frame.fullResolution && !cached.fullResolution);
+            if (!newer) {
+                return cached.texture;
+            }
+            // Out of the map so it cannot be evicted; its bytes count as free
+            previous = existing->second;
+            entries.erase(existing);
+        }
+        auto keepPrevious = [&]() -> SDL_Texture* {
+            if (previous.texture) {
+                entries[index] = previous;
+            }
+            return previous.texture;
+        };
+        
+        // YUV frames keep their planes as an IYUV texture; everything else is
+        // converted to textureFormat on upload, unless the decoder already did
+        SDL_BlendMode blendMode = frame.yuv || frame.opaque ? SDL_BLENDMODE_NONE : SDL_BLENDMODE_BLEND;
+        Uint32 format = frame.yuv ? static_cast<Uint32>(SDL_PIXELFORMAT_IYUV) : textureFormat;
+        int width = frame.yuv ? frame.yuv->width : frame.surface->w;
+        int height = frame.yuv ? frame.yuv->height : frame.surface->h;
+        size_t bytes = frame.yuv ? frame.yuv->pixels.size() 
+                                 : static_cast<size_t>(width) * height * SDL_BYTESPERPIXEL(textureFormat);
+        size_t incomingDistance = distance(index);
+        bool atPlayhead = incomingDistance == 0;
+        Entry entry;
+        
+        while (usedBytes - previous.bytes + (entry.texture ? 0 : bytes) > budgetBytes) {
+            auto victim = farthest();
+            size_t victimDistance = victim != entries.end() ? distance(victim->first) : 0;
+            if (victim == entries.end() || (victimDistance <= incomingDistance && !atPlayhead)) {
+                if (atPlayhead) {
+                    break;
+                }
+                if (entry.texture) {
+                    destroy(entry);
+                }
+                return keepPrevious();
+            }
+            
+            Entry evicted = victim->second;
+            entries.erase(victim);
+            if (!entry.texture && evicted.format == format && evicted.width == width && evicted.height == height) {
+                entry = evicted;
+            } else {
+                destroy(evicted);
+            }
+        }
+        
+        TraceScope span("upload", static_cast<int64_t>(index));
+        auto uploadStart = std::chrono::steady_clock::now();
+        if (!entry.texture) {
+            entry.texture = SDL_CreateTexture(renderer, format, SDL_TEXTUREACCESS_STREAMING, width, height);
+            if (!entry.texture) {
+                return keepPrevious();
+            }
+            SDL_SetTextureBlendMode(entry.texture, blendMode);
+            entry.blendMode = blendMode;
+            entry.format = format;
+            entry.width = width;
+            entry.height = height;
+            entry.bytes = bytes;
+            usedBytes += bytes;
+        } else if (entry.blendMode != blendMode) {
+            SDL_SetTextureBlendMode(entry.texture, blendMode);
+            entry.blendMode = blendMode;
+        }
+        
+        bool uploaded = frame.yuv 
+            ? writeYuvTexture(entry.texture, *frame.yuv, stats)
+            : writeStreamingTexture(entry.texture, textureFormat, width, height, frame.surface->format->format,
+                                    frame.surface->pixels, frame.surface->pitch, stats);
+        if (!uploaded) {
+            destroy(entry);
+            return keepPrevious();
+        }
+        latency.record(nanosecondsSince(uploadStart));
+        
+        if (previous.texture) {
+            destroy(previous);
+        }
+        entry.generation = frame.generation;
+        entry.fullResolution = frame.fullResolution;
+        entries[index] = entry;
+        return entry.texture;
+    }
+    
+    // Changes the budget, evicting the frames farthest from the playhead while
+    // the cache is over it. The frame at the playhead is kept.
+    void setBudget(size_t budget) {
+        budgetBytes = budget;
+        while (usedBytes > budgetBytes && entries.size() > 1) {
+            auto victim = farthest();
+            destroy(victim->second);
+            entries.erase(victim);
+        }
+    }
+    
+    size_t budget() const {
+        return budgetBytes;
+    }
+    
+    size_t residentFrames() const {
+        return entries.size();
+    }
+    
+    size_t residentBytes() const {
+        return usedBytes;
+    }
+    
+    const UploadStats& uploadStats() const {
+        return stats;
+    }
+    
+    const LatencyHistogram& uploadLatency() const {
+        return latency;
+    }
+    
+    // Rough number of frames the budget holds, based on the frames cached so far
+    size_t capacityFrames() const {
+        if (entries.empty()) {
+            return frameCount;
+        }
+        size_t averageBytes = std::max<size_t>(1, usedBytes / entries.size());
+        return std::max<size_t>(1, budgetBytes / averageBytes);
+    }
+};
+
+// Keeps the frames ahead of the playhead, in the current play direction, decoded
+// and in the frame cache. The lookahead depth follows the measured decode time so
+// that enough work is in flight to cover one decode latency at the target rate.
+// Queued jobs that fall outside the window are cancelled, and results for frames
+// the playhead has moved away from are dropped. At startup it also fills the
+// cache from the first frame onwards, in the background, until the budget is
+// reached.
+class Prefetcher {
+private:
+    static constexpr size_t minDepth = 4;
+    static constexpr size_t maxDepth = 512;
+    
+    DecodePool& pool;
+    FrameCache& cache;
+    size_t frameCount;
+    std::vector<char>& unreadable;
+    std::function<std::string(size_t)> frameName;
+    std::unordered_set<size_t> pending;
+    std::unordered_set<size_t> detailPending;
+    bool playheadUpdated = false;
+    size_t playhead = 0;
+    int direction = 1;
+    size_t depth = minDepth;
+    uint32_t generation = 0;
+    double averageDecodeMs = 0.0;
+    double frameBudgetMs = 1000.0 / 240;
+    bool filling = false;
+    bool fillStoppedByBudget = false;
+    size_t fillNext = 0;
+    size_t filledFrames = 0;
+    size_t loadedPrefix = 0;
+    std::unordered_set<size_t> fillPending;
+    
+    // Steps from the playhead to `index` in the play direction
+    size_t stepsAhead(size_t index) const {
+        size_t n = frameCount;
+        return direction > 0 ? (index + n - playhead) % n : (playhead + n - index) % n;
+    }
+    
+    // A frame whose texture is shared with later repeats is in the window if
+    // any frame of its run is
+    bool inWindow(size_t index) const {
+        size_t last = cache.runEnd(index);
+        return stepsAhead(index) <= depth || stepsAhead(last) <= depth || (index <= playhead && playhead <= last);
+    }
+    
+    void adaptDepth(double decodeMs) {
+        averageDecodeMs = averageDecodeMs == 0.0 ? decodeMs : averageDecodeMs * 0.9 + decodeMs * 0.1;
+        size_t latencyFrames = static_cast<size_t>(std::ceil(averageDecodeMs / frameBudgetMs));
+        size_t wanted = latencyFrames * 2 + pool.threadCount();
+        // Never plan further ahead than the cache can hold alongside the frames behind
+        size_t cacheLimit = std::max<size_t>(minDepth, cache.capacityFrames() * 3 / 4);
+        depth = std::clamp(wanted, minDepth, std::min(maxDepth, cacheLimit));
+    }
+    
+    void accept(DecodedFrame& frame, bool keep = false) {
+        pending.erase(frame.index);
+        detailPending.erase(frame.index);
+        bool fillFrame = fillPending.erase(frame.index) > 0;
+        if (!frame.hasPixels()) {
+            std::cerr << "Unable to load image " << frameName(frame.index) << ": " << frame.error << std::endl;
+            unreadable[frame.index] = 1;
+            return;
+        }
+        adaptDepth(frame.decodeMs);
+        if (keep || fillFrame || inWindow(frame.index)) {
+            bool replacing = cache.find(frame.index) != nullptr;
+            SDL_Texture* texture = cache.insert(frame.index, frame);
+            if (texture && replacing && cache.canonical(frame.index) == cache.canonical(playhead)) {
+                playheadUpdated = true;
+            }
+            if (fillFrame && texture) {
+                filledFrames++;
+            } else if (fillFrame) {
+                // The cache is full of frames nearer the playhead
+                fillNext = frameCount;
+                fillStoppedByBudget = true;
+            }
+        }
+        SDL_FreeSurface(frame.surface);
+    }
+    
+    // Keeps a few fill decodes in flight behind the playhead window's
+    void fill() {
+        while (filling && fillNext < frameCount && fillPending.size() < pool.threadCount() * 2) {
+            size_t index = fillNext++;
+            if (unreadable[index] || pending.count(index) || cache.find(index) || cache.canonical(index) != index) {
+                continue;
+            }
+            pending.insert(index);
+            fillPending.insert(index);
+            pool.submit(index);
+        }
+        while (loadedPrefix < frameCount && (cache.find(loadedPrefix) || unreadable[loadedPrefix])) {
+            loadedPrefix++;
+        }
+        if (filling && fillNext >= frameCount && fillPending.empty()) {
+            filling = false;
+        }
+    }
+
+public:
+    Prefetcher(DecodePool& decodePool, FrameCache& frameCache, size_t frames,
+               std::vector<char>& unreadableFrames, std::function<std::string(size_t)> describeFrame)
+        : pool(decodePool), cache(frameCache), frameCount(frames), unreadable(unreadableFrames),
+          frameName(std::move(describeFrame)) {}
+    
+    void setTargetFPS(int fps) {
+        frameBudgetMs = 1000.0 / std::max(1, fps);
+    }
+    
+    // Frames appended to the sequence; pending indices stay valid
+    void setFrameCount(size_t frames) {
+        frameCount = frames;
+    }
+    
+    // Frames cached for an older display target are decoded again, while the
+    // old texture keeps being shown until the new one arrives
+    void setGeneration(uint32_t displayGeneration) {
+        generation = displayGeneration;
+    }
+    
+    // Called once per loop iteration from the render thread. Returns true if the
+    // frame at the playhead was replaced by a better version and should be redrawn.
+    bool update(size_t currentIndex, int playDirection) {
+        playheadUpdated = false;
+        playhead = currentIndex;
+        direction = playDirection;
+        cache.setPlayhead(playhead, direction);
+        
+        DecodedFrame frame;
+        while (pool.tryResult(frame)) {
+            accept(frame);
+        }
+        
+        for (size_t index : pool.cancelIf([this](size_t index) { 
+                 return !inWindow(index) && !fillPending.count(index); })) {
+            pending.erase(index);
+            detailPending.erase(index);
+        }
+        
+        // Queue missing frames nearest first; a repeated frame is decoded once
+        size_t n = frameCount;
+        for (size_t step = 0; step <= depth && step < n; ++step) {
+            size_t index = cache.canonical(direction > 0 ? (playhead + step) % n : (playhead + n - step) % n);
+            if (unreadable[index] || pending.count(index) || 
+                (cache.find(index) && cache.generationOf(index) >= generation)) {
+                continue;
+            }
+            pending.insert(index);
+            pool.submit(index);
+        }
+        fill();
+        return playheadUpdated;
+    }
+    
+    // Starts filling the cache from frame 0; progress is made in update()
+    void startFill() {
+        filling = true;
+        fillStoppedByBudget = false;
+        fillNext = 0;
+        filledFrames = 0;
+        loadedPrefix = 0;
+    }
+    
+    bool isFilling() const {
+        return filling;
+    }
+    
+    bool fillReachedBudget() const {
+        return fillStoppedByBudget;
+    }
+    
+    size_t fillCount() const {
+        return filledFrames;
+    }
+    
+    // Number of frames from the start of the sequence that are ready to show
+    size_t readyPrefix() const {
+        return loadedPrefix;
+    }
+    
+    // Queues a full resolution decode of a frame cached as a reduced-scale preview
+    void requestFullResolution(size_t index) {
+        index = cache.canonical(index);
+        if (!cache.find(index) || cache.isFullResolution(index) || detailPending.count(index)) {
+            return;
+        }
+        detailPending.insert(index);
+        pool.submit(index, true);
+    }
+    
+    bool isPending(size_t index) const {
+        return pending.count(cache.canonical(index)) != 0;
+    }
+    
+    // Blocks until a pending frame has been decoded and handed to the cache
+    void waitFor(size_t index) {
+        index = cache.canonical(index);
+        DecodedFrame frame;
+        while (isPending(index) && pool.waitResult(frame)) {
+            accept(frame, frame.index == index);
+        }
+    }
+    
+    size_t currentDepth() const {
+        return depth;
+    }
+    
+    double decodeMs() const {
+        return averageDecodeMs;
+    }
+};
+
+#ifdef THD_WITH_LZ4
+// Decoded frames kept LZ4-compressed in RAM, for sequences whose decode costs
+// far more than LZ4 does (PNG, TIFF). Each frame is compressed as independent
+// bands of rows so that several threads can decompress one frame. Frames
+// farthest from the playhead are evicted first. Safe to use from the decode
+// threads.
+class CompressedFrameCache {
+private:
+    struct Band {
+        size_t offset;
+        int storedBytes;
+        int firstRow;
+        int rows;
+    };
+    
+    struct Frame {
+        int width = 0;
+        int height = 0;
+        int pitch = 0;
+        Uint32 format = SDL_PIXELFORMAT_UNKNOWN;
+        uint32_t generation = 0;
+        bool fullResolution = true;
+        bool opaque = true;
+        std::vector<Band> bands;
+        std::vector<char> data;
+    };
+    
+    static constexpr int rowsPerBand = 64;
+    
+    std::mutex mutex;
+    std::unordered_map<size_t, std::shared_ptr<const Frame>> frames;
+    size_t frameCount;
+    size_t budgetBytes;
+    size_t usedBytes = 0;
+    size_t playhead = 0;
+    int direction = 1;
+    uint64_t rawBytesIn = 0;
+    uint64_t storedBytesIn = 0;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> decompressedBytes{0};
+    std::atomic<uint64_t> decompressNs{0};
+    
+    // Makes room for `bytes` by evicting frames farther away than `index`
+    bool makeRoom(size_t index, size_t bytes) {
+        size_t incoming = playheadDistance(index, playhead, frameCount, direction);
+        while (usedBytes + bytes > budgetBytes) {
+            auto victim = frames.end();
+            size_t victimDistance = 0;
+            for (auto it = frames.begin(); it != frames.end(); ++it) {
+                size_t d = playheadDistance(it->first, playhead, frameCount, direction);
+                if (victim == frames.end() || d > victimDistance) {
+                    victim = it;
+                    victimDistance = d;
+                }
+            }
+            if (victim == frames.end() || victimDistance <= incoming) {
+                return false;
+            }
+            usedBytes -= victim->second->data.size();
+            frames.erase(victim);
+        }
+        return true;
+    }
+
+public:
+    CompressedFrameCache(size_t frames, size_t budget) : frameCount(frames), budgetBytes(budget) {}
+    
+    void setPlayhead(size_t index, int playDirection) {
+        std::lock_guard<std::mutex> lock(mutex);
+        playhead = index;
+        direction = playDirection;
+    }
+    
+    // Makes room for a frame inserted into the sequence at `position`
+    void insertFrame(size_t position) {
+        std::lock_guard<std::mutex> lock(mutex);
+        frameCount++;
+        if (position + 1 < frameCount) {
+            std::unordered_map<size_t, std::shared_ptr<const Frame>> shifted;
+            for (auto& item : frames) {
+                shifted.emplace(item.first >= position ? item.first + 1 : item.first, item.second);
+            }
+            frames.swap(shifted);
+            if (playhead >= position) {
+                playhead++;
+            }
+        }
+    }
+    
+    // Compresses and keeps a decoded frame, unless a frame at least as good is
+    // already stored or everything stored is nearer the playhead
+    void store(size_t index, const DecodedFrame& decoded) {
+        TraceScope span("lz4 compress", static_cast<int64_t>(index));
+        const SDL_Surface* surface = decoded.surface;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto existing = frames.find(index);
+            if (existing != frames.end() && existing->second->generation >= decoded.generation &&
+                (existing->second->fullResolution || !decoded.fullResolution)) {
+                return;
+            }
+        }
+        
+        auto frame = std::make_shared<Frame>();
+        frame->width = surface->w;
+        frame->height = surface->h;
+        frame->pitch = surface->pitch;
+        frame->format = surface->format->format;
+        frame->generation = decoded.generation;
+        frame->fullResolution = decoded.fullResolution;
+        frame->opaque = decoded.opaque;
+        size_t rawBytes = static_cast<size_t>(surface->pitch) * surface->h;
+        frame->data.resize(LZ4_compressBound(static_cast<int>(rowsPerBand * surface->pitch)) * 
+                           ((surface->h + rowsPerBand - 1) / rowsPerBand));
+        size_t offset = 0;
+        for (int row = 0; row < surface->h; row += rowsPerBand) {
+            int rows = std::min(rowsPerBand, surface->h - row);
+            int bandBytes = rows * surface->pitch;
+            int size = LZ4_compress_default(static_cast<const char*>(surface->pixels) + static_cast<size_t>(row) * surface->pitch,
+                                            frame->data.data() + offset, bandBytes, LZ4_compressBound(bandBytes));
+            if (size <= 0) {
+                return;
+            }
+            frame->bands.push_back({offset, size, row, rows});
+            offset += static_cast<size_t>(size);
+        }
+        frame->data.resize(offset);
+        frame->data.shrink_to_fit();
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        // The frame being replaced is set aside, its bytes counted as free, and
+        // put back if the new one is not admitted
+        std::shared_ptr<const Frame> previous;
+        auto existing = frames.find(index);
+        if (existing != frames.end()) {
+            previous = std::move(existing->second);
+            usedBytes -= previous->data.size();
+            frames.erase(existing);
+        }
+        if (!makeRoom(index, offset)) {
+            if (previous) {
+                usedBytes += previous->data.size();
+                frames[index] = std::move(previous);
+            }
+            return;
+        }
+        usedBytes += offset;
+        rawBytesIn += rawBytes;
+        storedBytesIn += offset;
+        frames[index] = std::move(frame);
+    }
+    
+    // Decompresses a stored frame sized for display generation `generation`
+    // into a new surface, spreading the bands over `threads` shared helpers. A
+    // reduced-scale preview is only returned when `previewAllowed`.
+    SDL_Surface* load(size_t index, uint32_t generation, bool previewAllowed, size_t threads,
+                      bool& fullResolution, bool& opaque) {
+        TraceScope span("lz4 load", static_cast<int64_t>(index));
+        std::shared_ptr<const Frame> frame;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = frames.find(index);
+            if (it != frames.end() && it->second->generation == generation &&
+                (it->second->fullResolution || previewAllowed)) {
+                frame = it->second;
+            }
+        }
+        if (!frame) {
+            misses++;
+            return nullptr;
+        }
+        
+        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, frame->width, frame->height, 
+                                                              SDL_BITSPERPIXEL(frame->format), frame->format);
+        if (!surface) {
+            return nullptr;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::atomic<bool> ok{true};
+        auto decompress = [&](size_t firstBand, size_t lastBand) {
+            std::vector<char> rows;
+            for (size_t b = firstBand; b < lastBand && ok; ++b) {
+                const Band& band = frame->bands[b];
+                int bandBytes = band.rows * frame->pitch;
+                char* out = static_cast<char*>(surface->pixels) + static_cast<size_t>(band.firstRow) * surface->pitch;
+                if (surface->pitch != frame->pitch) {
+                    rows.resize(bandBytes);
+                    out = rows.data();
+                }
+                if (LZ4_decompress_safe(frame->data.data() + band.offset, out, band.storedBytes, bandBytes) != bandBytes) {
+                    ok = false;
+                    return;
+                }
+                if (surface->pitch != frame->pitch) {
+                    int rowBytes = std::min(surface->pitch, frame->pitch);
+                    for (int y = 0; y < band.rows; ++y) {
+                        std::memcpy(static_cast<char*>(surface->pixels) + static_cast<size_t>(band.firstRow + y) * surface->pitch,
+                                    rows.data() + static_cast<size_t>(y) * frame->pitch, rowBytes);
+                    }
+                }
+            }
+        };
+        
+        size_t bandCount = frame->bands.size();
+        threads = std::clamp<size_t>(threads, 1, bandCount);
+        size_t bandsPerThread = (bandCount + threads - 1) / threads;
+        HelperPool::shared().run(threads, [&](size_t t) {
+            size_t first = t * bandsPerThread;
+            decompress(first, std::min(bandCount, first + bandsPerThread));
+        });
+        if (!ok) {
+            SDL_FreeSurface(surface);
+            misses++;
+            return nullptr;
+        }
+        
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        decompressNs += static_cast<uint64_t>(elapsed.count());
+        decompressedBytes += static_cast<uint64_t>(frame->pitch) * frame->height;
+        hits++;
+        fullResolution = frame->fullResolution;
+        opaque = frame->opaque;
+        return surface;
+    }
+    
+    size_t residentFrames() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return frames.size();
+    }
+    
+    size_t residentBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return usedBytes;
+    }
+    
+    // Decoded bytes per stored byte over every frame compressed so far
+    double compressionRatio() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return storedBytesIn ? static_cast<double>(rawBytesIn) / storedBytesIn : 0.0;
+    }
+    
+    // Decompressed MB per second of wall-clock decompression time
+    double decompressMBps() const {
+        uint64_t ns = decompressNs;
+        return ns ? decompressedBytes / (1024.0 * 1024.0) / (ns / 1e9) : 0.0;
+    }
+    
+    uint64_t hitCount() const {
+        return hits;
+    }
+    
+    uint64_t missCount() const {
+        return misses;
+    }
+};
+#endif
+
+// .thd timelapse pack: pre-decoded frames in a single file that is mmap'd for
+// playback. Layout is a ThdHeader, then one ThdFrameEntry per frame, then the
+// frame data with every frame starting on a page boundary. Integers are stored
+// little-endian; rows are tightly packed (pitch = width * bytes per pixel).
+static_assert(SDL_BYTEORDER == SDL_LIL_ENDIAN, ".thd packs are read and written in host byte order");
+
+struct ThdHeader {
+    char magic[4];          // "THD1"
+    uint32_t version;
+    uint32_t frameCount;
+    uint32_t pixelFormat;   // SDL_PixelFormatEnum shared by every frame
+    uint32_t flags;
+    uint32_t reserved[3];
+};
+
+// A zeroed entry is a placeholder for a frame that could not be decoded when
+// the pack was written
+struct ThdFrameEntry {
+    uint64_t offset;        // From the start of the file
+    uint32_t storedBytes;
+    uint32_t rawBytes;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+    uint32_t compression;
+};
+
+static constexpr char thdMagic[4] = {'T', 'H', 'D', '1'};
+static constexpr uint32_t thdVersion = 1;
+static constexpr uint32_t thdFlagCompressed = 1;   // At least one frame is compressed
+static constexpr uint32_t thdCompressionNone = 0;
+static constexpr uint32_t thdCompressionLZ4 = 1;
+static constexpr uint64_t thdFrameAlignment = 4096;
+static constexpr uint32_t thdMaxDimension = 65536;
+
+// Read-only view of a .thd pack. Opening maps the file and checks the header and
+// table bounds only, so it costs the same for ten frames or a million.
+class ThdPack {
+private:
+    int fd = -1;
+    const Uint8* base = nullptr;
+    size_t mappedBytes = 0;
+    const ThdHeader* header = nullptr;
+    const ThdFrameEntry* table = nullptr;
+
+public:
+    ThdPack() = default;
+    ThdPack(const ThdPack&) = delete;
+    ThdPack& operator=(const ThdPack&) = delete;
+    
+    ~ThdPack() {
+        if (base) {
+            munmap(const_cast<Uint8*>(base), mappedBytes);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    bool open(const std::string& path, std::string& error) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        
+        mappedBytes = static_cast<size_t>(info.st_size);
+        if (mappedBytes < sizeof(ThdHeader)) {
+            error = "file too small";
+            return false;
+        }
+        void* mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            error = std::strerror(errno);
+            return false;
+        }
+        base = static_cast<const Uint8*>(mapping);
+        header = reinterpret_cast<const ThdHeader*>(base);
+        table = reinterpret_cast<const ThdFrameEntry*>(base + sizeof(ThdHeader));
+        
+        if (std::memcmp(header->magic, thdMagic, sizeof(thdMagic)) != 0 || header->version != thdVersion) {
+            error = "not a version 1 .thd pack";
+            return false;
+        }
+        if (header->frameCount == 0 ||
+            sizeof(ThdHeader) + static_cast<uint64_t>(header->frameCount) * sizeof(ThdFrameEntry) > mappedBytes) {
+            error = "truncated frame table";
+            return false;
+        }
+        // Frames are copied and converted row by row, which needs whole bytes per pixel
+        Uint32 format = header->pixelFormat;
+        if (format == SDL_PIXELFORMAT_UNKNOWN || SDL_ISPIXELFORMAT_FOURCC(format) || SDL_ISPIXELFORMAT_INDEXED(format) ||
+            SDL_BYTESPERPIXEL(format) == 0 || SDL_BYTESPERPIXEL(format) > 4) {
+            error = "unsupported pixel format";
+            return false;
+        }
+        madvise(mapping, mappedBytes, MADV_SEQUENTIAL);
+        return true;
+    }
+    
+    size_t frameCount() const {
+        return header->frameCount;
+    }
+    
+    Uint32 pixelFormat() const {
+        return header->pixelFormat;
+    }
+    
+    bool hasCompressedFrames() const {
+        return (header->flags & thdFlagCompressed) != 0;
+    }
+    
+    const ThdFrameEntry& entry(size_t index) const {
+        return table[index];
+    }
+    
+    bool isPlaceholder(size_t index) const {
+        return table[index].width == 0;
+    }
+    
+    // Why frame `index` cannot be read, or nullptr if its entry is sound.
+    // Entries are checked here, one frame at a time, so opening stays O(1).
+    const char* frameProblem(size_t index) const {
+        const ThdFrameEntry& frame = table[index];
+        if (isPlaceholder(index)) {
+            return "unreadable when the pack was written";
+        }
+        uint64_t rowBytes = static_cast<uint64_t>(frame.width) * SDL_BYTESPERPIXEL(header->pixelFormat);
+        if (frame.height == 0 || frame.width > thdMaxDimension || frame.height > thdMaxDimension ||
+            frame.pitch < rowBytes || static_cast<uint64_t>(frame.pitch) * frame.height > frame.rawBytes ||
+            frame.rawBytes > INT32_MAX) {
+            return "corrupt frame size";
+        }
+        if (frame.offset > mappedBytes || frame.storedBytes > mappedBytes - frame.offset) {
+            return "frame data out of bounds";
+        }
+        bool encodingOk = frame.compression == thdCompressionNone ? frame.storedBytes >= frame.rawBytes 
+                                                                  : frame.compression == thdCompressionLZ4;
+        return encodingOk ? nullptr : "unsupported frame encoding";
+    }
+    
+    // Stored bytes of a frame, or nullptr if frameProblem() finds its entry unsound
+    const Uint8* data(size_t index) const {
+        return frameProblem(index) ? nullptr : base + table[index].offset;
+    }
+    
+    // Pixels of an uncompressed frame, in place in the mapping, or nullptr
+    const Uint8* pixels(size_t index) const {
+        return table[index].compression == thdCompressionNone ? data(index) : nullptr;
+    }
+    
+    // Asks the kernel to start paging a frame in ahead of use
+    void willNeed(size_t index) const {
+        const ThdFrameEntry& frame = table[index];
+        if (data(index)) {
+            uint64_t start = frame.offset & ~(thdFrameAlignment - 1);
+            madvise(const_cast<Uint8*>(base + start), frame.offset - start + frame.storedBytes, MADV_WILLNEED);
+        }
+    }
+    
+    // Unpacks a frame into a new surface of the requested format
+    SDL_Surface* decode(size_t index, Uint32 format, std::string& error) const {
+        const ThdFrameEntry& frame = table[index];
+        const Uint8* stored = data(index);
+        if (!stored) {
+            error = frameProblem(index);
+            return nullptr;
+        }
+        
+        std::vector<Uint8> unpacked;
+        const Uint8* pixels = stored;
+        if (frame.compression == thdCompressionLZ4) {
+#ifdef THD_WITH_LZ4
+            unpacked.resize(frame.rawBytes);
+            int size = LZ4_decompress_safe(reinterpret_cast<const char*>(stored), 
+                                           reinterpret_cast<char*>(unpacked.data()),
+                                           static_cast<int>(frame.storedBytes), static_cast<int>(frame.rawBytes));
+            if (size != static_cast<int>(frame.rawBytes)) {
+                error = "corrupt LZ4 frame";
+                return nullptr;
+            }
+            pixels = unpacked.data();
+#else
+            error = "pack uses LZ4 but this build has no LZ4 support (rebuild with -DTHD_WITH_LZ4 -llz4)";
+            return nullptr;
+#endif
+        }
+        
+        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, frame.width, frame.height, 
+                                                              SDL_BITSPERPIXEL(format), format);
+        if (!surface) {
+            error = SDL_GetError();
+            return nullptr;
+        }
+        if (SDL_ConvertPixels(frame.width, frame.height, header->pixelFormat, pixels, frame.pitch,
+                              format, surface->pixels, surface->pitch) != 0) {
+            error = SDL_GetError();
+            SDL_FreeSurface(surface);
+            return nullptr;
+        }
+        return surface;
+    }
+};
+
+// Writes frames to a .thd pack in sequence order. The header and frame table are
+// reserved up front and filled in by finish().
+class ThdPackWriter {
+private:
+    std::ofstream out;
+    ThdHeader header = {};
+    std::vector<ThdFrameEntry> table;
+    size_t written = 0;
+    uint64_t rawTotal = 0;
+    uint64_t storedTotal = 0;
+
+public:
+    bool open(const std::string& path, size_t frames, Uint32 format) {
+        out.open(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        std::memcpy(header.magic, thdMagic, sizeof(thdMagic));
+        header.version = thdVersion;
+        header.frameCount = static_cast<uint32_t>(frames);
+        header.pixelFormat = format;
+        table.assign(frames, ThdFrameEntry{});
+        
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(ThdFrameEntry));
+        return static_cast<bool>(out);
+    }
+    
+    // Surfaces must be in the pack's pixel format and arrive in frame order
+    bool addFrame(SDL_Surface* surface, bool compress) {
+        ThdFrameEntry& frame = table[written++];
+        uint32_t rowBytes = static_cast<uint32_t>(surface->w) * SDL_BYTESPERPIXEL(header.pixelFormat);
+        std::vector<Uint8> raw(static_cast<size_t>(rowBytes) * surface->h);
+        for (int y = 0; y < surface->h; ++y) {
+            std::memcpy(raw.data() + static_cast<size_t>(y) * rowBytes,
+                        static_cast<const Uint8*>(surface->pixels) + static_cast<size_t>(y) * surface->pitch, rowBytes);
+        }
+        
+        frame.width = surface->w;
+        frame.height = surface->h;
+        frame.pitch = rowBytes;
+        frame.rawBytes = static_cast<uint32_t>(raw.size());
+        frame.storedBytes = frame.rawBytes;
+        frame.compression = thdCompressionNone;
+        
+        const std::vector<Uint8>* stored = &raw;
+        std::vector<Uint8> packed;
+#ifdef THD_WITH_LZ4
+        if (compress) {
+            packed.resize(LZ4_compressBound(static_cast<int>(raw.size())));
+            int size = LZ4_compress_default(reinterpret_cast<const char*>(raw.data()),
+                                            reinterpret_cast<char*>(packed.data()),
+                                            static_cast<int>(raw.size()), static_cast<int>(packed.size()));
+            // Keep frames that do not shrink uncompressed so they stay zero-copy
+            if (size > 0 && static_cast<size_t>(size) < raw.size()) {
+                packed.resize(size);
+                stored = &packed;
+                frame.storedBytes = static_cast<uint32_t>(size);
+                frame.compression = thdCompressionLZ4;
+                header.flags |= thdFlagCompressed;
+            }
+        }
+#else
+        (void)compress;
+#endif
+        
+        uint64_t position = static_cast<uint64_t>(out.tellp());
+        uint64_t aligned = (position + thdFrameAlignment - 1) & ~(thdFrameAlignment - 1);
+        std::vector<char> padding(aligned - position, 0);
+        out.write(padding.data(), padding.size());
+        frame.offset = aligned;
+        out.write(reinterpret_cast<const char*>(stored->data()), stored->size());
+        
+        rawTotal += frame.rawBytes;
+        storedTotal += frame.storedBytes;
+        return static_cast<bool>(out);
+    }
+    
+    // Leaves the next frame's entry zeroed, for a frame that could not be decoded
+    void addPlaceholder() {
+        written++;
+    }
+    
+    bool finish() {
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(ThdFrameEntry));
+        out.close();
+        return !out.fail();
+    }
+    
+    uint64_t rawBytes() const {
+        return rawTotal;
+    }
+    
+    uint64_t storedBytes() const {
+        return storedTotal;
+    }
+};
+
+// Stream parameters from a YUV4MPEG2 header line. Chroma planes are
+// subsampled by 1 << chromaShiftX horizontally and 1 << chromaShiftY
+// vertically (4:2:0 is 1, 1); mono streams have no chroma planes.
+struct Y4mFormat {
+    int width = 0;
+    int height = 0;
+    int chromaShiftX = 1;
+    int chromaShiftY = 1;
+    bool mono = false;
+    bool fullRange = false;
+    int rateNumerator = 25;
+    int rateDenominator = 1;
+    
+    int chromaWidth() const {
+        return (width + (1 << chromaShiftX) - 1) >> chromaShiftX;
+    }
+    
+    int chromaHeight() const {
+        return (height + (1 << chromaShiftY) - 1) >> chromaShiftY;
+    }
+    
+    size_t frameBytes() const {
+        size_t luma = static_cast<size_t>(width) * height;
+        return mono ? luma : luma + 2 * static_cast<size_t>(chromaWidth()) * chromaHeight();
+    }
+    
+    // Parses the header line, without its trailing newline
+    bool parse(const std::string& line, std::string& error) {
+        if (line.compare(0, 10, "YUV4MPEG2 ") != 0) {
+            error = "not a YUV4MPEG2 stream";
+            return false;
+        }
+        size_t start = 10;
+        while (start < line.size()) {
+            size_t end = line.find(' ', start);
+            std::string field = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            start = end == std::string::npos ? line.size() : end + 1;
+            if (field.empty()) {
+                continue;
+            }
+            std::string value = field.substr(1);
+            switch (field[0]) {
+                case 'W':
+                    width = std::atoi(value.c_str());
+                    break;
+                case 'H':
+                    height = std::atoi(value.c_str());
+                    break;
+                case 'F':
+                    if (std::sscanf(value.c_str(), "%d:%d", &rateNumerator, &rateDenominator) != 2 ||
+                        rateNumerator <= 0 || rateDenominator <= 0) {
+                        rateNumerator = 25;
+                        rateDenominator = 1;
+                    }
+                    break;
+                case 'C':
+                    // Only 8-bit layouts; C420p10 and friends have 16-bit samples
+                    if (value == "420" || value == "420jpeg" || value == "420paldv" || value == "420mpeg2") {
+                        chromaShiftX = chromaShiftY = 1;
+                    } else if (value == "422") {
+                        chromaShiftX = 1;
+                        chromaShiftY = 0;
+                    } else if (value == "444") {
+                        chromaShiftX = chromaShiftY = 0;
+                    } else if (value == "mono") {
+                        mono = true;
+                    } else {
+                        error = "unsupported colour space C" + value + " (only 8-bit 420, 422, 444 and mono are supported)";
+                        return false;
+                    }
+                    break;
+                case 'X':
+                    if (value == "COLORRANGE=FULL") {
+                        fullRange = true;
+                    }
+                    break;
+            }
+        }
+        if (width <= 0 || height <= 0) {
+            error = "missing frame size";
+            return false;
+        }
+        return true;
+    }
+    
+    std::string header() const {
+        std::string line = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + 
+                           " F" + std::to_string(rateNumerator) + ":" + std::to_string(rateDenominator) + " Ip A1:1";
+        line += mono ? " Cmono" : chromaShiftY ? " C420jpeg" : chromaShiftX ? " C422" : " C444";
+        if (fullRange) {
+            line += " XCOLORRANGE=FULL";
+        }
+        return line + "\n";
+    }
+};
+
+// Points `planes` at the Y, U and V planes of one frame in `data` for an IYUV
+// texture. 4:2:0 frames are used in place; other layouts get their chroma
+// averaged down to 4:2:0 (or set to grey for mono) in `scratch`.
+void y4mPlanes(const Y4mFormat& format, const Uint8* data, YuvFrame& scratch, PixelPlane (&planes)[3]) {
+    planes[0] = {const_cast<Uint8*>(data), format.width, format.height, format.width};
+    if (!format.mono && format.chromaShiftX == 1 && format.chromaShiftY == 1) {
+        size_t chromaBytes = static_cast<size_t>(format.chromaWidth()) * format.chromaHeight();
+        for (int p = 1; p < 3; ++p) {
+            Uint8* plane = const_cast<Uint8*>(data) + static_cast<size_t>(format.width) * format.height + (p - 1) * chromaBytes;
+            planes[p] = {plane, format.chromaWidth(), format.chromaHeight(), format.chromaWidth()};
+        }
+        return;
+    }
+    
+    if (scratch.width != format.width || scratch.height != format.height) {
+        scratch = YuvFrame(format.width, format.height);
+    }
+    int stepX = 2 >> format.chromaShiftX;
+    int stepY = 2 >> format.chromaShiftY;
+    for (int p = 1; p < 3; ++p) {
+        PixelPlane out = scratch.plane(p);
+        planes[p] = out;
+        if (format.mono) {
+            std::memset(out.pixels, 128, static_cast<size_t>(out.pitch) * out.height);
+            continue;
+        }
+        const Uint8* in = data + static_cast<size_t>(format.width) * format.height + 
+                          (p - 1) * static_cast<size_t>(format.chromaWidth()) * format.chromaHeight();
+        int inWidth = format.chromaWidth();
+        int inHeight = format.chromaHeight();
+        for (int y = 0; y < out.height; ++y) {
+            for (int x = 0; x < out.width; ++x) {
+                int sum = 0;
+                int count = 0;
+                for (int dy = 0; dy < stepY && y * stepY + dy < inHeight; ++dy) {
+                    for (int dx = 0; dx < stepX && x * stepX + dx < inWidth; ++dx) {
+                        sum += in[static_cast<size_t>(y * stepY + dy) * inWidth + x * stepX + dx];
+                        count++;
+                    }
+                }
+                out.pixels[static_cast<size_t>(y) * out.pitch + x] = static_cast<Uint8>((sum + count / 2) / count);
+            }
+        }
+    }
+}
+
+// Frames that are already raw video and need no decoding; the viewer uploads
+// them straight into IYUV textures
+class RawVideoSource {
+public:
+    virtual ~RawVideoSource() = default;
+    
+    virtual const Y4mFormat& format() const = 0;
+    
+    // Frames available so far; grows while a stream is being read
+    virtual size_t frameCount() const = 0;
+    
+    // False for streams, which only keep a bounded window of frames
+    virtual bool seekable() const = 0;
+    
+    // Planes of frame `index`, valid until the next call
+    virtual bool planes(size_t index, PixelPlane (&out)[3], std::string& error) = 0;
+};
+
+// A .y4m file mapped into memory. Frame offsets follow from the header when
+// every frame marker is a bare "FRAME", so seeking is O(1); files with frame
+// parameters, or whose sampled markers do not line up, are indexed with one
+// pass over the markers instead.
+class Y4mFile : public RawVideoSource {
+private:
+    int fd = -1;
+    const Uint8* base = nullptr;
+    size_t mappedBytes = 0;
+    Y4mFormat videoFormat;
+    size_t firstFrame = 0;
+    size_t stride = 0;           // Marker plus frame data, when all markers are bare
+    size_t frames = 0;
+    std::vector<size_t> offsets; // Frame data offsets, only when they are not
+    YuvFrame scratch{0, 0};
+    
+    // Offset just past the newline ending the line at `offset`, or 0
+    size_t lineEnd(size_t offset) const {
+        const void* newline = std::memchr(base + offset, '\n', std::min<size_t>(mappedBytes - offset, 4096));
+        return newline ? static_cast<const Uint8*>(newline) - base + 1 : 0;
+    }
+
+public:
+    Y4mFile() = default;
+    Y4mFile(const Y4mFile&) = delete;
+    Y4mFile& operator=(const Y4mFile&) = delete;
+    
+    ~Y4mFile() override {
+        if (base) {
+            munmap(const_cast<Uint8*>(base), mappedBytes);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    bool open(const std::string& path, std::string& error) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        mappedBytes = static_cast<size_t>(info.st_size);
+        if (mappedBytes == 0) {
+            error = "empty file";
+            return false;
+        }
+        void* mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            error = std::strerror(errno);
+            return false;
+        }
+        base = static_cast<const Uint8*>(mapping);
+        madvise(mapping, mappedBytes, MADV_SEQUENTIAL);
+        
+        firstFrame = lineEnd(0);
+        if (firstFrame == 0 || 
+            !videoFormat.parse(std::string(reinterpret_cast<const char*>(base), firstFrame - 1), error)) {
+            error = firstFrame == 0 ? "missing header" : error;
+            return false;
+        }
+        
+        // Assume bare markers, then check the first, the last and an even
+        // spread of markers in between; one frame with parameters shifts
+        // every marker after it
+        size_t frameBytes = videoFormat.frameBytes();
+        stride = 6 + frameBytes;
+        frames = (mappedBytes - firstFrame) / stride;
+        const size_t samples = 64;
+        bool bare = frames > 0;
+        for (size_t i = 0; bare && i < std::min(frames, samples); ++i) {
+            size_t frame = frames <= samples ? i : i * (frames - 1) / (samples - 1);
+            bare = std::memcmp(base + firstFrame + frame * stride, "FRAME\n", 6) == 0;
+        }
+        if (bare) {
+            return true;
+        }
+        
+        frames = 0;
+        for (size_t offset = firstFrame; offset + 5 < mappedBytes;) {
+            size_t data = lineEnd(offset);
+            if (std::memcmp(base + offset, "FRAME", 5) != 0 || data == 0 || frameBytes > mappedBytes - data) {
+                break;
+            }
+            offsets.push_back(data);
+            offset = data + frameBytes;
+        }
+        frames = offsets.size();
+        if (frames == 0) {
+            error = "no complete frames";
+            return false;
+        }
+        return true;
+    }
+    
+    const Y4mFormat& format() const override {
+        return videoFormat;
+    }
+    
+    size_t frameCount() const override {
+        return frames;
+    }
+    
+    bool seekable() const override {
+        return true;
+    }
+    
+    bool planes(size_t index, PixelPlane (&out)[3], std::string& error) override {
+        if (index >= frames) {
+            error = "frame out of range";
+            return false;
+        }
+        size_t offset = offsets.empty() ? firstFrame + index * stride + 6 : offsets[index];
+        y4mPlanes(videoFormat, base + offset, scratch, out);
+        return true;
+    }
+};
+
+// A Y4M stream read from a pipe. A reader thread stays up to `capacity`
+// frames ahead of playback; frames before the one last shown are dropped, so
+// memory stays bounded however long the stream runs.
+class Y4mStream : public RawVideoSource {
+private:
+    int fd;
+    size_t capacity;
+    Y4mFormat videoFormat;
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<Uint8>> buffered;
+    size_t firstBuffered = 0;    // Index of buffered.front()
+    bool ended = false;
+    bool stopping = false;
+    std::vector<Uint8> current;  // Frame handed out by planes()
+    YuvFrame scratch{0, 0};
+    std::thread reader;
+    
+    // Reads exactly `bytes`, polling so that the destructor can stop a reader
+    // waiting on an idle pipe
+    bool readFully(Uint8* out, size_t bytes) {
+        size_t done = 0;
+        while (done < bytes) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) {
+                    return false;
+                }
+            }
+            struct pollfd waiting = {fd, POLLIN, 0};
+            int ready = poll(&waiting, 1, 100);
+            if (ready < 0 && errno != EINTR) {
+                return false;
+            }
+            if (ready <= 0) {
+                continue;
+            }
+            ssize_t got = read(fd, out + done, bytes - done);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            done += static_cast<size_t>(got);
+        }
+        return true;
+    }
+    
+    bool readLine(std::string& line) {
+        line.clear();
+        Uint8 c = 0;
+        while (line.size() < 4096) {
+            if (!readFully(&c, 1)) {
+                return false;
+            }
+            if (c == '\n') {
+                return true;
+            }
+            line.push_back(static_cast<char>(c));
+        }
+        return false;
+    }
+    
+    void readLoop() {
+        TraceRecorder::nameThread("stream reader");
+        std::string marker;
+        while (readLine(marker) && marker.compare(0, 5, "FRAME") == 0) {
+            std::vector<Uint8> frame(videoFormat.frameBytes());
+            if (!readFully(frame.data(), frame.size())) {
+                break;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return stopping || buffered.size() < capacity; });
+            if (stopping) {
+                return;
+            }
+            buffered.push_back(std::move(frame));
+            changed.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        ended = true;
+        changed.notify_all();
+    }
+
+public:
+    explicit Y4mStream(int inputFd, size_t bufferedFrames) 
+        : fd(inputFd), capacity(std::max<size_t>(2, bufferedFrames)) {}
+    Y4mStream(const Y4mStream&) = delete;
+    Y4mStream& operator=(const Y4mStream&) = delete;
+    
+    ~Y4mStream() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        if (reader.joinable()) {
+            reader.join();
+        }
+    }
+    
+    // Reads the header and waits for the first frame
+    bool open(std::string& error) {
+        std::string header;
+        if (!readLine(header)) {
+            error = "missing header";
+            return false;
+        }
+        if (!videoFormat.parse(header, error)) {
+            return false;
+        }
+        reader = std::thread(&Y4mStream::readLoop, this);
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return ended || !buffered.empty(); });
+        if (buffered.empty()) {
+            error = "no complete frames";
+            return false;
+        }
+        return true;
+    }
+    
+    const Y4mFormat& format() const override {
+        return videoFormat;
+    }
+    
+    size_t frameCount() const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        return firstBuffered + buffered.size();
+    }
+    
+    bool seekable() const override {
+        return false;
+    }
+    
+    // Moves playback to frame `index`, dropping the frames before it
+    bool planes(size_t index, PixelPlane (&out)[3], std::string& error) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index + 1 == firstBuffered && !current.empty()) {
+            y4mPlanes(videoFormat, current.data(), scratch, out);
+            return true;
+        }
+        if (index < firstBuffered || index >= firstBuffered + buffered.size()) {
+            error = index < firstBuffered ? "frame no longer buffered" : "frame not read yet";
+            return false;
+        }
+        while (firstBuffered <= index) {
+            current = std::move(buffered.front());
+            buffered.pop_front();
+            firstBuffered++;
+        }
+        changed.notify_all();
+        y4mPlanes(videoFormat, current.data(), scratch, out);
+        return true;
+    }
+};
+
+// Identifies one decoded version of a source image. The variant distinguishes
+// different decodes of the same file (for example different output sizes).
+struct FrameKey {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    std::string variant;
+    
+    std::string text() const {
+        return path + '\n' + std::to_string(size) + '\n' + std::to_string(mtimeNs) + '\n' + variant;
+    }
+};
+
+bool statFrameKey(const std::string& path, FrameKey& key) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    key.path = path;
+    key.size = static_cast<uint64_t>(info.st_size);
+    key.mtimeNs = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+uint64_t fnv1a64(const std::string& text) {
+    uint64_t hash = 1469598103934665603ull;
+    for (unsigned char c : text) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Decoded frames persisted across sessions, one file per frame named by a hash
+// of its FrameKey. The full key is stored in each file and checked on load, so a
+// changed source file (size or mtime) is simply a miss. Reading a frame touches
+// its mtime, and when the directory grows past its limit the least recently used
+// files are deleted. Safe to use from several decode threads at once.
+class DiskFrameCache {
+private:
+    struct FileHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t pitch;
+        uint32_t format;
+        uint32_t keyBytes;
+        uint32_t reserved;
+    };
+    
+    static constexpr char fileMagic[4] = {'T', 'H', 'D', 'C'};
+    static constexpr uint32_t fileVersion = 1;
+    
+    std::string directory;
+    uint64_t limitBytes = 0;
+    std::atomic<uint64_t> usedBytes{0};
+    std::mutex evictMutex;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    
+    std::string fileFor(const FrameKey& key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.frame", static_cast<unsigned long long>(fnv1a64(key.text())));
+        return directory + "/" + name;
+    }
+    
+    // Deletes least recently used frames until the cache is 90% of its limit.
+    // Temporary files left by a write that never finished (a crash, say) are
+    // deleted once they are old enough not to be another writer's; newer ones
+    // count toward the limit.
+    void evict() {
+        std::unique_lock<std::mutex> lock(evictMutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+        
+        struct CachedFile {
+            fs::path path;
+            uint64_t bytes;
+            fs::file_time_type lastUse;
+        };
+        std::vector<CachedFile> files;
+        uint64_t total = 0;
+        std::error_code ec;
+        auto staleBefore = fs::file_time_type::clock::now() - std::chrono::minutes(10);
+        for (const auto& entry : fs::directory_iterator(directory, ec)) {
+            if (entry.path().extension() == ".frame") {
+                uint64_t bytes = entry.file_size(ec);
+                files.push_back({entry.path(), bytes, entry.last_write_time(ec)});
+                total += bytes;
+            } else if (entry.path().filename().string().find(".frame.tmp") != std::string::npos) {
+                uint64_t bytes = entry.file_size(ec);
+                if (ec) {
+                    continue;
+                }
+                auto lastWrite = entry.last_write_time(ec);
+                if (ec || lastWrite >= staleBefore || !fs::remove(entry.path(), ec)) {
+                    total += bytes;
+                }
+            }
+        }
+        
+        std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b) {
+            return a.lastUse < b.lastUse;
+        });
+        uint64_t target = limitBytes / 10 * 9;
+        for (const auto& file : files) {
+            if (total <= target) {
+                break;
+            }
+            if (fs::remove(file.path, ec)) {
+                total -= file.bytes;
+            }
+        }
+        usedBytes = total;
+    }
+
+public:
+    // Default location: $XDG_CACHE_HOME/timelapse_viewer or ~/.cache/timelapse_viewer
+    static std::string defaultDirectory() {
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            return std::string(xdg) + "/timelapse_viewer";
+        }
+        const char* home = std::getenv("HOME");
+        return std::string(home ? home : ".") + "/.cache/timelapse_viewer";
+    }
+    
+    bool open(const std::string& cacheDirectory, uint64_t maxBytes) {
+        directory = cacheDirectory;
+        limitBytes = maxBytes;
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        if (!fs::is_directory(directory, ec)) {
+            std::cerr << "Unable to create disk cache directory " << directory << std::endl;
+            return false;
+        }
+        evict();
+        std::cout << "Disk cache " << directory << ": " << usedBytes / (1024 * 1024) << "/" 
+                  << limitBytes / (1024 * 1024) << " MB used" << std::endl;
+        return true;
+    }
+    
+    // Returns the cached decode of `key`, or nullptr on a miss
+    SDL_Surface* load(const FrameKey& key) {
+        TraceScope span("disk cache read");
+        std::string path = fileFor(key);
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            misses++;
+            return nullptr;
+        }
+        
+        std::string keyText = key.text();
+        FileHeader header;
+        std::string storedKey;
+        SDL_Surface* surface = nullptr;
+        if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+            std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) == 0 && header.version == fileVersion &&
+            header.keyBytes == keyText.size()) {
+            storedKey.resize(header.keyBytes);
+            if (read(fd, &storedKey[0], storedKey.size()) == static_cast<ssize_t>(storedKey.size()) &&
+                storedKey == keyText) {
+                surface = SDL_CreateRGBSurfaceWithFormat(0, header.width, header.height,
+                                                         SDL_BITSPERPIXEL(header.format), header.format);
+            }
+        }
+        
+        bool ok = surface != nullptr;
+        if (ok && static_cast<uint32_t>(surface->pitch) == header.pitch) {
+            size_t bytes = static_cast<size_t>(header.pitch) * header.height;
+            ok = read(fd, surface->pixels, bytes) == static_cast<ssize_t>(bytes);
+        } else if (ok) {
+            size_t rowBytes = std::min<size_t>(header.pitch, surface->pitch);
+            std::vector<Uint8> row(header.pitch);
+            for (uint32_t y = 0; ok && y < header.height; ++y) {
+                ok = read(fd, row.data(), row.size()) == static_cast<ssize_t>(row.size());
+                std::memcpy(static_cast<Uint8*>(surface->pixels) + static_cast<size_t>(y) * surface->pitch,
+                            row.data(), rowBytes);
+            }
+        }
+        
+        if (ok) {
+            // Mark as recently used for eviction
+            futimens(fd, nullptr);
+            hits++;
+        } else {
+            if (surface) {
+                SDL_FreeSurface(surface);
+                surface = nullptr;
+            }
+            misses++;
+        }
+        close(fd);
+        return surface;
+    }
+    
+    void store(const FrameKey& key, SDL_Surface* surface) {
+        TraceScope span("disk cache write");
+        std::string path = fileFor(key);
+        std::string temporary = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        std::string keyText = key.text();
+        
+        FileHeader header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+        header.version = fileVersion;
+        header.width = surface->w;
+        header.height = surface->h;
+        header.pitch = surface->pitch;
+        header.format = surface->format->format;
+        header.keyBytes = static_cast<uint32_t>(keyText.size());
+        
+        size_t pixelBytes = static_cast<size_t>(surface->pitch) * surface->h;
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(keyText.data(), keyText.size());
+            out.write(static_cast<const char*>(surface->pixels), pixelBytes);
+            if (!out) {
+                std::error_code ec;
+                fs::remove(temporary, ec);
+                return;
+            }
+        }
+        // Rename so readers never see a partially written frame
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::error_code ec;
+            fs::remove(temporary, ec);
+            return;
+        }
+        
+        if ((usedBytes += sizeof(header) + keyText.size() + pixelBytes) > limitBytes) {
+            evict();
+        }
+    }
+    
+    uint64_t hitCount() const {
+        return hits;
+    }
+    
+    uint64_t missCount() const {
+        return misses;
+    }
+};
+
+// The image files of a directory in sorted order, with the size, mtime and
+// dimensions of each once a decode has seen them. The directory is read with
+// getdents64 and filtered on each entry's d_type, so regular files cost no
+// stat; names live in one buffer rather than a string per path. The index is
+// saved as a sidecar file in the cache directory (writing into the image
+// directory would change the mtime it is validated against) and reused while
+// the directory's mtime is unchanged. Names can be added while frames are
+// being decoded; readers take a shared lock.
+class SequenceIndex {
+public:
+    struct FileInfo {
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        uint32_t width = 0;   // 0 until the frame has been decoded
+        uint32_t height = 0;
+    };
+
+private:
+    struct FileHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t count;
+        int64_t directoryMtimeNs;
+        uint64_t nameBytes;
+        uint32_t directoryBytes;
+        uint32_t reserved;
+    };
+    
+    static constexpr char fileMagic[4] = {'T', 'H', 'D', 'I'};
+    static constexpr uint32_t fileVersion = 1;
+    
+    std::string directory;
+    std::string canonicalDirectory;
+    int64_t directoryMtimeNs = 0;
+    std::string names;                  // All names back to back, sorted
+    std::vector<uint32_t> nameOffsets;  // count + 1 offsets into names
+    std::vector<FileInfo> files;
+    std::string sidecarPath;
+    bool loadedFromSidecar = false;
+    mutable std::shared_mutex mutex;
+    std::atomic<bool> dirty{false};
+    
+    static bool isImageName(std::string_view name) {
+        size_t dot = name.rfind('.');
+        if (dot == std::string_view::npos) {
+            return false;
+        }
+        std::string extension(name.substr(dot));
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        return extension == ".jpg" || extension == ".jpeg" || extension == ".png" || 
+               extension == ".bmp" || extension == ".tif" || extension == ".tiff";
+    }
+    
+    // Reads the directory and sorts the names found
+    bool scan(std::string& error) {
+        std::string found;
+        std::vector<uint32_t> starts;
+        auto add = [&](const char* name, size_t length) {
+            starts.push_back(static_cast<uint32_t>(found.size()));
+            found.append(name, length);
+        };
+        
+#ifdef __linux__
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        std::vector<char> buffer(1 << 20);
+        for (;;) {
+            long bytes = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+            if (bytes < 0) {
+                error = std::strerror(errno);
+                close(fd);
+                return false;
+            }
+            if (bytes == 0) {
+                break;
+            }
+            for (long offset = 0; offset < bytes;) {
+                const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+                offset += entry->d_reclen;
+                size_t length = std::strlen(entry->d_name);
+                if (!isImageName(std::string_view(entry->d_name, length))) {
+                    continue;
+                }
+                // Symlinks, and filesystems that don't fill in d_type, still need a stat
+                bool regular = entry->d_type == DT_REG;
+                if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                    struct stat info;
+                    regular = fstatat(fd, entry->d_name, &info, 0) == 0 && S_ISREG(info.st_mode);
+                }
+                if (regular) {
+                    add(entry->d_name, length);
+                }
+            }
+        }
+        close(fd);
+#else
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(directory, ec)) {
+            std::string name = entry.path().filename().string();
+            if (isImageName(name) && entry.is_regular_file(ec)) {
+                add(name.data(), name.size());
+            }
+        }
+        if (ec) {
+            error = ec.message();
+            return false;
+        }
+#endif
+        if (found.size() > UINT32_MAX) {
+            error = "too many files";
+            return false;
+        }
+        starts.push_back(static_cast<uint32_t>(found.size()));
+        
+        // Sort a permutation of the names, then lay them out in that order
+        auto nameAt = [&](uint32_t i) {
+            return std::string_view(found.data() + starts[i], starts[i + 1] - starts[i]);
+        };
+        size_t count = starts.size() - 1;
+        std::vector<uint32_t> order(count);
+        for (size_t i = 0; i < count; ++i) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return nameAt(a) < nameAt(b);
+        });
+        
+        names.clear();
+        names.reserve(found.size());
+        nameOffsets.clear();
+        nameOffsets.reserve(count + 1);
+        for (uint32_t i : order) {
+            nameOffsets.push_back(static_cast<uint32_t>(names.size()));
+            names.append(nameAt(i));
+        }
+        nameOffsets.push_back(static_cast<uint32_t>(names.size()));
+        files.assign(count, FileInfo());
+        return true;
+    }
+    
+    bool load() {
+        std::ifstream in(sidecarPath, std::ios::binary);
+        FileHeader header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) != 0 || header.version != fileVersion ||
+            header.directoryMtimeNs != directoryMtimeNs || header.directoryBytes != canonicalDirectory.size() ||
+            header.nameBytes > UINT32_MAX) {
+            return false;
+        }
+        std::string storedDirectory(header.directoryBytes, '\0');
+        if (!in.read(&storedDirectory[0], storedDirectory.size()) || storedDirectory != canonicalDirectory) {
+            return false;
+        }
+        
+        // The counts must add up to the file's size before anything is sized
+        // from them, so a truncated or corrupt sidecar means a rescan rather
+        // than a huge allocation
+        struct stat info;
+        if (stat(sidecarPath.c_str(), &info) != 0) {
+            return false;
+        }
+        uint64_t fileBytes = static_cast<uint64_t>(info.st_size);
+        uint64_t tableBytes = fileBytes - std::min<uint64_t>(fileBytes, sizeof(header) + header.directoryBytes);
+        if (header.count > tableBytes / (sizeof(uint32_t) + sizeof(FileInfo)) || header.nameBytes > tableBytes ||
+            (header.count + 1) * sizeof(uint32_t) + header.count * sizeof(FileInfo) + header.nameBytes != tableBytes) {
+            return false;
+        }
+        
+        nameOffsets.resize(header.count + 1);
+        files.resize(header.count);
+        names.resize(header.nameBytes);
+        in.read(reinterpret_cast<char*>(nameOffsets.data()), nameOffsets.size() * sizeof(uint32_t));
+        in.read(reinterpret_cast<char*>(files.data()), files.size() * sizeof(FileInfo));
+        in.read(&names[0], names.size());
+        if (!in || nameOffsets.front() != 0 || nameOffsets.back() != names.size() ||
+            !std::is_sorted(nameOffsets.begin(), nameOffsets.end())) {
+            names.clear();
+            nameOffsets.clear();
+            files.clear();
+            return false;
+        }
+        return true;
+    }
+
+public:
+    // Indexes `directoryPath`, reusing a valid sidecar from `indexDirectory` and
+    // writing a new one after a scan. An empty indexDirectory always scans.
+    bool open(const std::string& directoryPath, const std::string& indexDirectory, std::string& error) {
+        struct stat info;
+        if (stat(directoryPath.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+            error = "not a directory";
+            return false;
+        }
+        directory = directoryPath;
+        if (!directory.empty() && directory.back() == '/') {
+            directory.pop_back();
+        }
+        directoryMtimeNs = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        std::error_code ec;
+        canonicalDirectory = fs::weakly_canonical(directoryPath, ec).string();
+        
+        sidecarPath.clear();
+        loadedFromSidecar = false;
+        if (!indexDirectory.empty()) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.idx", static_cast<unsigned long long>(fnv1a64(canonicalDirectory)));
+            sidecarPath = indexDirectory + "/" + name;
+            if ((loadedFromSidecar = load())) {
+                return true;
+            }
+        }
+        
+        if (!scan(error)) {
+            return false;
+        }
+        dirty = true;
+        save();
+        return true;
+    }
+    
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return files.size();
+    }
+    
+    bool fromSidecar() const {
+        return loadedFromSidecar;
+    }
+    
+    std::string path(size_t index) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        std::string result = directory;
+        result += '/';
+        result.append(names, nameOffsets[index], nameOffsets[index + 1] - nameOffsets[index]);
+        return result;
+    }
+    
+    FileInfo info(size_t index) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return files[index];
+    }
+    
+    // Adds a file name in sort order, returning false if it is not an image or
+    // is already indexed. Finding the position is a binary search and appending
+    // is amortised O(1); a name that sorts earlier moves the names after it.
+    bool insert(const std::string& name, size_t& position) {
+        if (!isImageName(name)) {
+            return false;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto nameAt = [this](size_t i) {
+            return std::string_view(names.data() + nameOffsets[i], nameOffsets[i + 1] - nameOffsets[i]);
+        };
+        size_t count = files.size();
+        size_t low = 0;
+        size_t high = count;
+        if (count == 0 || nameAt(count - 1) < name) {
+            low = count;
+        }
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (nameAt(middle) < name) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if ((low < count && nameAt(low) == name) || names.size() + name.size() > UINT32_MAX) {
+            return false;
+        }
+        
+        uint32_t offset = nameOffsets[low];
+        names.insert(offset, name);
+        nameOffsets.insert(nameOffsets.begin() + low, offset);
+        for (size_t i = low + 1; i < nameOffsets.size(); ++i) {
+            nameOffsets[i] += static_cast<uint32_t>(name.size());
+        }
+        files.insert(files.begin() + low, FileInfo());
+        dirty = true;
+        position = low;
+        return true;
+    }
+    
+    // Records a frame's full resolution size the first time it is decoded,
+    // along with the file's size and mtime. Called from the decode threads.
+    void recordDecode(size_t index, int width, int height) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            if (files[index].width != 0) {
+                return;
+            }
+        }
+        struct stat info;
+        std::string filePath = path(index);
+        if (stat(filePath.c_str(), &info) != 0) {
+            return;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        FileInfo& file = files[index];
+        file.size = static_cast<uint64_t>(info.st_size);
+        file.mtimeNs = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        file.width = static_cast<uint32_t>(width);
+        file.height = static_cast<uint32_t>(height);
+        dirty = true;
+    }
+    
+    // Writes the sidecar if anything changed since it was read or written
+    bool save() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        if (!dirty || sidecarPath.empty()) {
+            return true;
+        }
+        std::error_code ec;
+        fs::create_directories(fs::path(sidecarPath).parent_path(), ec);
+        
+        FileHeader header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+        header.version = fileVersion;
+        header.count = files.size();
+        header.directoryMtimeNs = directoryMtimeNs;
+        header.nameBytes = names.size();
+        header.directoryBytes = static_cast<uint32_t>(canonicalDirectory.size());
+        
+        std::string temporary = sidecarPath + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(canonicalDirectory.data(), canonicalDirectory.size());
+            out.write(reinterpret_cast<const char*>(nameOffsets.data()), nameOffsets.size() * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(FileInfo));
+            out.write(names.data(), names.size());
+            if (!out) {
+                fs::remove(temporary, ec);
+                return false;
+            }
+        }
+        if (std::rename(temporary.c_str(), sidecarPath.c_str()) != 0) {
+            fs::remove(temporary, ec);
+            return false;
+        }
+        dirty = false;
+        return true;
+    }
+};
+
+// Reads a whole file into memory
+bool readWholeFile(const std::string& path, std::vector<Uint8>& bytes) {
+    TraceScope span("read file");
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    bytes.resize(static_cast<size_t>(info.st_size));
+    size_t done = 0;
+    while (done < bytes.size()) {
+        ssize_t count = read(fd, bytes.data() + done, bytes.size() - done);
+        if (count <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(count);
+    }
+    close(fd);
+    return done == bytes.size();
+}
+
+// Encoded image files kept in RAM so decoding reads from memory instead of the
+// disk. A reader thread loads the files nearest the playhead first, ranked like
+// the frame cache ranks textures. Once the budget is reached it swaps the
+// farthest file for a nearer one as the playhead moves. Encoded frames are
+// typically a tenth of their decoded size, so this tier reaches far beyond the
+// texture cache; when the whole sequence fits, playback does no disk I/O at all.
+class EncodedStore {
+private:
+    SequenceIndex& sequence;
+    size_t budgetBytes;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<EncodedBytes> files;
+    std::vector<char> failed;
+    size_t failedCount = 0;
+    std::unordered_set<size_t> resident;
+    size_t usedBytes = 0;
+    size_t playhead = 0;
+    int direction = 1;
+    uint64_t revision = 0;   // Bumped when indices shift
+    bool blocked = false;    // Full of files nearer than the next one needed
+    bool stopping = false;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::thread reader;
+    
+    // Nearest file in the play direction that is not loaded, or files.size()
+    size_t nextWanted() const {
+        size_t n = files.size();
+        if (resident.size() + failedCount >= n) {
+            return n;
+        }
+        for (size_t step = 0; step < n; ++step) {
+            size_t index = direction > 0 ? (playhead + step) % n : (playhead + n - step) % n;
+            if (!files[index] && !failed[index]) {
+                return index;
+            }
+        }
+        return n;
+    }
+    
+    // Evicts files farther away than `index` until `bytes` more fit
+    bool makeRoom(size_t index, size_t bytes) {
+        size_t n = files.size();
+        size_t incoming = playheadDistance(index, playhead, n, direction);
+        while (usedBytes + bytes > budgetBytes) {
+            size_t victim = n;
+            size_t victimDistance = 0;
+            for (size_t candidate : resident) {
+                size_t d = playheadDistance(candidate, playhead, n, direction);
+                if (victim == n || d > victimDistance) {
+                    victim = candidate;
+                    victimDistance = d;
+                }
+            }
+            if (victim == n || victimDistance <= incoming) {
+                return false;
+            }
+            usedBytes -= files[victim]->size();
+            files[victim].reset();
+            resident.erase(victim);
+        }
+        return true;
+    }
+    
+    void readLoop() {
+        TraceRecorder::nameThread("file reader");
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            size_t index = blocked ? files.size() : nextWanted();
+            if (index == files.size()) {
+                wake.wait(lock);
+                continue;
+            }
+            
+            uint64_t startRevision = revision;
+            std::string path = sequence.path(index);
+            lock.unlock();
+            auto bytes = std::make_shared<std::vector<Uint8>>();
+            bool ok = readWholeFile(path, *bytes);
+            lock.lock();
+            if (revision != startRevision || files[index]) {
+                continue;
+            }
+            if (!ok) {
+                failed[index] = 1;
+                failedCount++;
+            } else if (makeRoom(index, bytes->size())) {
+                usedBytes += bytes->size();
+                files[index] = std::move(bytes);
+                resident.insert(index);
+            } else {
+                blocked = true;
+            }
+        }
+    }
+
+public:
+    EncodedStore(SequenceIndex& index, size_t budget)
+        : sequence(index), budgetBytes(budget), files(index.size()), failed(index.size(), 0) {
+        reader = std::thread(&EncodedStore::readLoop, this);
+    }
+    
+    ~EncodedStore() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        reader.join();
+    }
+    
+    void setPlayhead(size_t index, int playDirection) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index == playhead && playDirection == direction) {
+            return;
+        }
+        playhead = index;
+        direction = playDirection;
+        blocked = false;
+        wake.notify_one();
+    }
+    
+    // Makes room for a frame inserted into the sequence at `position`
+    void insertFrame(size_t position) {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.insert(files.begin() + position, nullptr);
+        failed.insert(failed.begin() + position, 0);
+        if (position + 1 < files.size()) {
+            std::unordered_set<size_t> shifted;
+            for (size_t index : resident) {
+                shifted.insert(index >= position ? index + 1 : index);
+            }
+            resident.swap(shifted);
+            if (playhead >= position) {
+                playhead++;
+            }
+        }
+        revision++;
+        blocked = false;
+        wake.notify_one();
+    }
+    
+    // The file's bytes if they are loaded
+    EncodedBytes find(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        EncodedBytes bytes = index < files.size() ? files[index] : nullptr;
+        (bytes ? hits : misses)++;
+        return bytes;
+    }
+    
+    size_t residentFrames() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return resident.size();
+    }
+    
+    size_t residentBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return usedBytes;
+    }
+    
+    uint64_t hitCount() const {
+        return hits;
+    }
+    
+    uint64_t missCount() const {
+        return misses;
+    }
+};
+
+// Luminance thumbnail of a frame, used to spot repeated frames. Each cell is
+// the average of a grid of samples from its part of the image, so sensor
+// noise mostly cancels out.
+struct FrameSignature {
+    static constexpr int size = 16;
+    
+    int width = 0;
+    int height = 0;
+    Uint8 luma[size * size] = {};
+};
+
+// Samples taken per cell along each axis, so large frames cost no more than small ones
+static constexpr int signatureSamples = 8;
+
+bool computeSignature(SDL_Surface* surface, FrameSignature& signature, std::string& error) {
+    ChannelLayout layout;
+    if (!channelLayout(surface->format->format, layout)) {
+        surface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGB24, 0);
+        if (!surface) {
+            error = SDL_GetError();
+            return false;
+        }
+        bool ok = computeSignature(surface, signature, error);
+        SDL_FreeSurface(surface);
+        return ok;
+    }
+    
+    signature.width = surface->w;
+    signature.height = surface->h;
+    int grid = FrameSignature::size * signatureSamples;
+    for (int cy = 0; cy < FrameSignature::size; ++cy) {
+        for (int cx = 0; cx < FrameSignature::size; ++cx) {
+            uint32_t sum = 0;
+            for (int sy = 0; sy < signatureSamples; ++sy) {
+                int y = static_cast<int>((cy * signatureSamples + sy) * static_cast<int64_t>(surface->h) / grid);
+                const Uint8* row = static_cast<const Uint8*>(surface->pixels) + static_cast<size_t>(y) * surface->pitch;
+                for (int sx = 0; sx < signatureSamples; ++sx) {
+                    int x = static_cast<int>((cx * signatureSamples + sx) * static_cast<int64_t>(surface->w) / grid);
+                    const Uint8* pixel = row + x * layout.bytes;
+                    sum += (pixel[layout.offset[0]] * 77u + pixel[layout.offset[1]] * 150u + 
+                            pixel[layout.offset[2]] * 29u) >> 8;
+                }
+            }
+            signature.luma[cy * FrameSignature::size + cx] = static_cast<Uint8>(sum / (signatureSamples * signatureSamples));
+        }
+    }
+    return true;
+}
+
+// Signatures come from full-size decodes and from frames already fitted to the
+// display, so frames match on aspect ratio (to within 1%) rather than size
+bool sameShape(const FrameSignature& a, const FrameSignature& b) {
+    uint64_t across = static_cast<uint64_t>(a.width) * b.height;
+    uint64_t down = static_cast<uint64_t>(b.width) * a.height;
+    return (across > down ? across - down : down - across) * 100 <= std::max(across, down);
+}
+
+// Sum of absolute luma differences between two signatures
+uint32_t signatureDifference(const FrameSignature& a, const FrameSignature& b) {
+    return static_cast<uint32_t>(sumAbsDifference(a.luma, b.luma, sizeof(a.luma)));
+}
+
+// Background pass that finds runs of repeated frames, such as the identical
+// night frames of an interval camera. Each frame is compared with the first
+// frame of the current run, in frame order, so a slow drift never chains into
+// one long run. Frames with a reduced-scale decode (JPEGs, with libjpeg) are
+// decoded here at 1/8 scale. Any other frame would cost a full second decode,
+// so the scan instead waits for the decode workers to offer() a signature
+// taken from the frame they decode anyway. The render thread collects the
+// repeats with take() and points them at the first frame's texture.
+class DuplicateScanner {
+public:
+    // A frame whose signature matched the first frame of its run
+    struct Repeat {
+        size_t index;
+        size_t original;
+    };
+    
+    // Average difference, in grey levels per cell, still counted as the same frame
+    static constexpr uint32_t maxMeanDifference = 2;
+
+private:
+    std::function<ImageSource(size_t)> source;
+    std::mutex mutex;
+    std::condition_variable wake;
+    size_t frameCount;
+    size_t next = 0;
+    size_t awaiting = SIZE_MAX;                 // Frame left to the decode workers
+    std::chrono::steady_clock::time_point awaitDeadline;
+    static constexpr std::chrono::seconds workerGrace{2};
+    std::map<size_t, FrameSignature> offered;   // From the workers; width 0 if unreadable
+    bool haveRun = false;
+    size_t runStart = 0;
+    FrameSignature runSignature;
+    std::vector<Repeat> found;
+    size_t repeats = 0;
+    bool busy = false;
+    bool stopping = false;
+    std::thread scanner;
+    
+    bool sign(const ImageSource& image, FrameSignature& signature) {
+        std::string error;
+        SDL_Surface* surface = nullptr;
+#ifdef THD_WITH_LIBJPEG
+        if (isJpegPath(image.path)) {
+            JpegScale scale;
+            surface = loadJpegScaled(image, FrameSignature::size * signatureSamples, 
+                                     FrameSignature::size * signatureSamples, scale, error);
+        }
+#endif
+        if (!surface) {
+            surface = loadSurface(image, SDL_PIXELFORMAT_UNKNOWN, error);
+        }
+        if (!surface) {
+            return false;
+        }
+        bool ok = computeSignature(surface, signature, error);
+        SDL_FreeSurface(surface);
+        return ok;
+    }
+    
+    void scanLoop() {
+        TraceRecorder::nameThread("duplicate scan");
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (next >= frameCount) {
+                wake.wait(lock);
+                continue;
+            }
+            
+            size_t index = next;
+            FrameSignature signature;
+            bool ok = false;
+            auto offer = offered.find(index);
+            if (offer != offered.end()) {
+                signature = offer->second;
+                ok = signature.width > 0;
+                offered.erase(offer);
+            } else if (awaiting == index && std::chrono::steady_clock::now() < awaitDeadline) {
+                wake.wait_until(lock, awaitDeadline);
+                continue;
+            } else {
+                busy = true;
+                lock.unlock();
+                ImageSource image = source(index);
+                // Frames the workers never decode (already on screen, say) are
+                // signed here once they have had their chance
+                bool signedHere = signsItself(image.path) || awaiting == index;
+                if (signedHere) {
+                    ok = sign(image, signature);
+                }
+                lock.lock();
+                busy = false;
+                if (!signedHere) {
+                    awaiting = index;
+                    awaitDeadline = std::chrono::steady_clock::now() + workerGrace;
+                    continue;
+                }
+            }
+            next++;
+            if (!ok) {
+                // An unreadable frame ends the run
+                haveRun = false;
+                continue;
+            }
+            if (haveRun && sameShape(signature, runSignature) &&
+                signatureDifference(signature, runSignature) <= 
+                    maxMeanDifference * FrameSignature::size * FrameSignature::size) {
+                found.push_back({index, runStart});
+                repeats++;
+            } else {
+                haveRun = true;
+                runStart = index;
+                runSignature = signature;
+            }
+        }
+    }
+
+public:
+    // True for images the scanner decodes itself at a reduced scale
+    static bool signsItself(const std::string& path) {
+#ifdef THD_WITH_LIBJPEG
+        return isJpegPath(path);
+#else
+        (void)path;
+        return false;
+#endif
+    }
+    
+    // Whether a decode worker should sign frame `index` for the scan
+    bool wants(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return index >= next && index < frameCount && offered.count(index) == 0;
+    }
+    
+    // A decode worker's signature for a frame, or nullptr if it was unreadable
+    void offer(size_t index, const FrameSignature* signature) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (index < next || index >= frameCount) {
+                return;
+            }
+            offered[index] = signature ? *signature : FrameSignature();
+        }
+        wake.notify_one();
+    }
+    
+    DuplicateScanner(size_t frames, std::function<ImageSource(size_t)> imageSource)
+        : source(std::move(imageSource)), frameCount(frames) {
+        scanner = std::thread(&DuplicateScanner::scanLoop, this);
+    }
+    
+    ~DuplicateScanner() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        scanner.join();
+    }
+    
+    // Frames appended to the sequence are scanned too
+    void setFrameCount(size_t frames) {
+        std::lock_guard<std::mutex> lock(mutex);
+        frameCount = frames;
+        wake.notify_one();
+    }
+    
+    // Repeats found since the last call, in frame order
+    std::vector<Repeat> take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Repeat> taken;
+        taken.swap(found);
+        return taken;
+    }
+    
+    bool finished() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next >= frameCount && !busy;
+    }
+    
+    size_t scannedFrames() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return next;
+    }
+    
+    size_t repeatCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return repeats;
+    }
+};
+
+// Reports files that finish being written to, or are renamed into, a directory
+// using inotify. poll() never blocks, so the render loop can call it every
+// iteration. An overflowed event queue means names were lost and the caller
+// should rescan.
+class DirectoryWatcher {
+private:
+    int fd = -1;
+
+public:
+    DirectoryWatcher() = default;
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+    
+    ~DirectoryWatcher() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    bool open(const std::string& directory, std::string& error) {
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+            error = std::strerror(errno);
+            return false;
+        }
+        return true;
+#else
+        error = "directory watching needs inotify";
+        return false;
+#endif
+    }
+    
+    // Appends the names reported since the last call; returns false on overflow
+    bool poll(std::vector<std::string>& names) {
+        bool complete = true;
+#ifdef __linux__
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        ssize_t bytes;
+        while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < bytes;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+                offset += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    complete = false;
+                } else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                    names.push_back(event->name);
+                }
+            }
+        }
+#endif
+        return complete;
+    }
+};
+
+// Reads a single number from a cgroup file; false for "max" or a missing file
+bool readCgroupValue(const std::string& path, uint64_t& value) {
+    std::ifstream in(path);
+    std::string text;
+    if (!(in >> text) || text == "max") {
+        return false;
+    }
+    value = std::strtoull(text.c_str(), nullptr, 10);
+    return true;
+}
+
+// Memory this process could still allocate: MemAvailable from /proc/meminfo,
+// lowered to the headroom below memory.max of its cgroup v2 group and of each
+// ancestor. Returns false if neither source could be read.
+bool readAvailableMemory(uint64_t& availableBytes, bool& cgroupLimited) {
+    bool known = false;
+    cgroupLimited = false;
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    uint64_t kilobytes = 0;
+    std::string unit;
+    while (meminfo >> key >> kilobytes >> unit) {
+        if (key == "MemAvailable:") {
+            availableBytes = kilobytes * 1024;
+            known = true;
+            break;
+        }
+    }
+    
+    // cgroup v2 membership is the "0::<path>" line
+    std::ifstream membership("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(membership, line)) {
+        if (line.compare(0, 3, "0::") != 0) {
+            continue;
+        }
+        fs::path group = "/sys/fs/cgroup";
+        fs::path relative = fs::path(line.substr(3)).relative_path();
+        if (!relative.empty()) {
+            group /= relative;
+        }
+        for (;; group = group.parent_path()) {
+            uint64_t limit = 0;
+            uint64_t current = 0;
+            if (readCgroupValue((group / "memory.max").string(), limit) &&
+                readCgroupValue((group / "memory.current").string(), current)) {
+                uint64_t headroom = limit > current ? limit - current : 0;
+                if (!known || headroom < availableBytes) {
+                    availableBytes = headroom;
+                    cgroupLimited = true;
+                }
+                known = true;
+            }
+            if (group == "/sys/fs/cgroup" || !group.has_relative_path()) {
+                break;
+            }
+        }
+        break;
+    }
+    return known;
+}
+
+// Where the frame time goes: latency histograms for each stage of showing a
+// frame, and the playback frames that missed the target frame time. Decode
+// times come in from the worker threads; everything else is recorded on the
+// render thread.
+class FrameTimings {
+public:
+    enum Stage { decode, upload, acquire, renderCopy, present, frameInterval, pacingError, stageCount };
+
+private:
+    static constexpr const char* stageNames[stageCount] = {
+        "decode", "upload", "acquire", "render_copy", "present", "frame_interval", "pacing_error"
+    };
+    
+    std::vector<LatencyHistogram> stages;
+    std::mutex decodeMutex;
+    int targetFPS = 240;
+    uint64_t frameBudgetNs = 1000000000 / 240; // 0 when playback is unpaced
+    uint64_t lateFrames = 0;
+    uint64_t droppedFrames = 0;
+    std::chrono::steady_clock::time_point lastPresent;
+    bool presenting = false;
+
+public:
+    FrameTimings() : stages(stageCount) {}
+    
+    // 0 is unpaced playback, which has no budget to be late against
+    void setTargetFPS(int fps) {
+        targetFPS = std::max(0, fps);
+        frameBudgetNs = targetFPS > 0 ? 1000000000ull / targetFPS : 0;
+    }
+    
+    bool paced() const {
+        return frameBudgetNs > 0;
+    }
+    
+    void record(Stage stage, uint64_t ns) {
+        stages[stage].record(ns);
+    }
+    
+    void recordDecode(uint64_t ns) {
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        stages[decode].record(ns);
+    }
+    
+    // Stages measured elsewhere, such as uploads inside the texture caches
+    void replace(Stage stage, const LatencyHistogram& histogram) {
+        stages[stage] = histogram;
+    }
+    
+    // A playback frame reached the screen. A frame that took longer than the
+    // frame budget is late; each further whole budget is a frame dropped.
+    void framePresented() {
+        auto now = std::chrono::steady_clock::now();
+        if (presenting) {
+            uint64_t interval = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastPresent).count());
+            stages[frameInterval].record(interval);
+            if (paced() && interval > frameBudgetNs) {
+                lateFrames++;
+                droppedFrames += interval / frameBudgetNs - 1;
+            }
+        }
+        lastPresent = now;
+        presenting = true;
+    }
+    
+    // Playback paused or held, so the next frame's wait is not an interval
+    void pause() {
+        presenting = false;
+    }
+    
+    uint64_t late() const {
+        return lateFrames;
+    }
+    
+    uint64_t dropped() const {
+        return droppedFrames;
+    }
+    
+    void writeJson(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        out << "{" << std::endl;
+        out << "  \"target_fps\": " << targetFPS << "," << std::endl;
+        out << "  \"paced\": " << (paced() ? "true" : "false") << "," << std::endl;
+        if (paced()) {
+            out << "  \"late_frames\": " << lateFrames << "," << std::endl;
+            out << "  \"dropped_frames\": " << droppedFrames << "," << std::endl;
+        } else {
+            out << "  \"late_frames\": null," << std::endl;
+            out << "  \"dropped_frames\": null," << std::endl;
+        }
+        out << "  \"stages\": {" << std::endl;
+        for (int stage = 0; stage < stageCount; ++stage) {
+            out << "    \"" << stageNames[stage] << "\": ";
+            stages[stage].writeJson(out);
+            out << (stage + 1 < stageCount ? "," : "") << std::endl;
+        }
+        out << "  }" << std::endl;
+        out << "}" << std::endl;
+    }
+    
+    // One row per stage; the frame counts go in rows of their own with only a count
+    void writeCsv(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        out << "stage,count,mean_us,p50_us,p90_us,p99_us,max_us" << std::endl;
+        for (int stage = 0; stage < stageCount; ++stage) {
+            stages[stage].writeCsvRow(out, stageNames[stage]);
+        }
+        if (paced()) {
+            out << "late_frames," << lateFrames << ",,,,," << std::endl;
+            out << "dropped_frames," << droppedFrames << ",,,,," << std::endl;
+        } else {
+            out << "late_frames,unpaced,,,,," << std::endl;
+            out << "dropped_frames,unpaced,,,,," << std::endl;
+        }
+    }
+    
+    // One line per stage in milliseconds, for the exit report
+    void writeSummary(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(decodeMutex);
+        for (int stage = 0; stage < stageCount; ++stage) {
+            const LatencyHistogram& histogram = stages[stage];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            out << "  " << stageNames[stage] << ": p50 " << histogram.percentile(50) / 1e6 << " ms, p90 " 
+                << histogram.percentile(90) / 1e6 << " ms, p99 " << histogram.percentile(99) / 1e6 
+                << " ms, max " << histogram.maxValue() / 1e6 << " ms (" << histogram.count() << " samples)" << std::endl;
+        }
+        if (paced()) {
+            out << "  " << lateFrames << " late and " << droppedFrames << " dropped frames at " << targetFPS << " FPS" << std::endl;
+        } else {
+            out << "  Late and dropped frames not counted: playback is unpaced (--fps 0)" << std::endl;
+        }
+    }
+};
+
+// Paces playback to a target rate in nanoseconds. Deadlines are computed from
+// the frames shown since the last restart (start + n / fps) instead of adding
+// a rounded period each frame, so they never drift. Sleeps overshoot, so a
+// wait sleeps until shortly before the deadline and spins the rest of the way.
+class FramePacer {
+public:
+    static constexpr uint64_t spinNs = 1000000;      // Spin through the last millisecond
+    static constexpr uint64_t maxSleepNs = 5000000;  // Sleep in slices so events keep flowing
+
+private:
+    using Clock = std::chrono::steady_clock;
+    
+    int fps = 0;
+    bool started = false;
+    Clock::time_point origin;
+    uint64_t frame = 0;         // Frames since origin; the next one is due at deadline(frame)
+    uint64_t skippedSlots = 0;
+    
+    Clock::time_point deadline(uint64_t n) const {
+        return origin + std::chrono::nanoseconds(static_cast<int64_t>(n * 1000000000ull / static_cast<uint64_t>(fps)));
+    }
+    
+    static void relax() {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    }
+
+public:
+    // 0 = unpaced, every wait returns at once
+    void setRate(int framesPerSecond) {
+        fps = std::max(0, framesPerSecond);
+        restart();
+    }
+    
+    bool paced() const {
+        return fps > 0;
+    }
+    
+    // The next frame is due immediately and starts a new schedule, as after a pause
+    void restart() {
+        started = false;
+    }
+    
+    uint64_t remainingNs() {
+        if (!paced()) {
+            return 0;
+        }
+        if (!started) {
+            origin = Clock::now();
+            frame = 0;
+            started = true;
+        }
+        auto due = deadline(frame);
+        auto now = Clock::now();
+        return due > now ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(due - now).count()) : 0;
+    }
+    
+    // Sleeps towards the next deadline while more than `leadNs` remains, in
+    // slices of at most maxSleepNs
+    void sleep(uint64_t leadNs) {
+        uint64_t remaining = remainingNs();
+        if (remaining > leadNs) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(remaining - leadNs, maxSleepNs)));
+        }
+    }
+    
+    // Spins until the next frame is due and takes its slot. Returns how far
+    // past the deadline it returned, in nanoseconds. A caller that fell a whole
+    // frame behind skips the missed slots rather than rushing through them.
+    uint64_t wait() {
+        if (!paced()) {
+            return 0;
+        }
+        remainingNs();
+        auto due = deadline(frame);
+        while (Clock::now() < due) {
+            relax();
+        }
+        auto now = Clock::now();
+        frame++;
+        if (now >= deadline(frame)) {
+            double elapsedNs = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - origin).count());
+            uint64_t next = static_cast<uint64_t>(elapsedNs * fps / 1e9) + 1;
+            skippedSlots += next - frame;
+            frame = next;
+        }
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - due).count());
+    }
+    
+    uint64_t skipped() const {
+        return skippedSlots;
+    }
+};
+
+struct ViewerOptions {
+    bool fullscreen = false;
+    int fps = 240;
+    int threads = 0;  // 0 = one per hardware thread
+    size_t cacheMB = 0;  // 0 = size from available memory
+    bool diskCache = false;
+    std::string diskCacheDirectory;
+    size_t diskCacheMB = 8192;
+    bool downscale = true;
+    bool yuv = false;
+    bool sequenceIndex = true;
+    bool watch = false;
+    bool follow = false;
+    long encodedMB = -1;  // -1 = a quarter of the available memory, 0 = off
+    size_t lz4CacheMB = 0;  // 0 = off
+    bool dedupe = false;
+    bool skipDuplicates = false;
+    bool delta = false;
+    size_t keyframeInterval = 30;
+    int deltaTolerance = 0;
+    size_t streamFrames = 32;  // Frames read ahead from a stream on stdin
+    std::string exportPath;    // Write the sequence as Y4M here ("-" = stdout) instead of playing it
+    int exportWidth = 0;       // 0 = size of the first frame
+    int exportHeight = 0;
+    bool benchmark = false;
+    size_t benchmarkFrames = 200;  // 0 = every frame
+    std::string timingsPath;       // Frame timings written here on exit and on T (.csv or JSON)
+    std::string tracePath;         // Chrome trace of the session written here on exit
+    bool exactPacing = false;      // Present at the target rate itself instead of with vsync
+};
+
 class TimelapseViewer {
 private:
     SDL_Window* window = nullptr;
     SDL_Renderer* renderer = nullptr;
-    std::vector<std::string> imagePaths;
-    std::vector<SDL_Texture*> textures;
+    SequenceIndex sequence;
+    std::string indexDirectory;
+    std::vector<char> unreadable;
+    FrameCache frameCache;
+    size_t cacheBudgetCap = 0;
+    std::chrono::steady_clock::time_point lastBudgetCheck;
+    std::unique_ptr<DecodePool> decodePool;
+    std::unique_ptr<Prefetcher> prefetcher;
+    std::unique_ptr<ThdPack> pack;
+    StreamingRing streamingRing;
+    std::unique_ptr<DiskFrameCache> diskCache;
+    std::unique_ptr<DirectoryWatcher> watcher;
+    std::unique_ptr<EncodedStore> encodedStore;
+    long encodedBudgetMB = -1;
+#ifdef THD_WITH_LZ4
+    std::unique_ptr<CompressedFrameCache> compressedCache;
+#endif
+    size_t compressedCacheMB = 0;
+    std::shared_ptr<DuplicateScanner> duplicateScanner;
+    std::mutex duplicateScannerMutex;   // Decode workers read duplicateScanner too
+    bool findDuplicates = false;
+    bool skipDuplicates = false;
+    bool duplicatesReported = false;
+    std::unique_ptr<DeltaFrameStore> deltaStore;
+    bool deltaStorage = false;
+    size_t keyframeInterval = 30;
+    int deltaTolerance = 0;
+    std::map<size_t, SDL_Surface*> deltaReady;  // Decoded ahead of their turn in the store
+    size_t deltaSubmitted = 0;
+    bool deltaBuilding = false;
+    bool deltaStoreFull = false;
+    std::unique_ptr<RawVideoSource> rawVideo;
+    size_t streamFrames = 32;
+    std::string watchedDirectory;
+    bool watchDirectory = false;
+    bool followTail = false;
+    
+    // Largest size a frame can be displayed at; decoded frames are downscaled to
+    // fit it. The generation increases whenever the target grows.
+    struct DisplayTarget {
+        int width = 0;
+        int height = 0;
+        uint32_t generation = 0;
+    };
+    bool downscale = true;
+    bool yuvDecoding = false;
+    std::mutex displayTargetMutex;
+    DisplayTarget displayTarget;
+    int playDirection = 1;
+    size_t stalls = 0;
     size_t currentIndex = 0;
     bool running = true;
     bool playing = false;
@@ -22,6 +4774,23 @@ private:
     bool fullscreen = false;
     int windowWidth = 1280;
     int windowHeight = 720;
+    size_t decodeThreads = 1;
+    Uint32 textureFormat = FrameCache::defaultTextureFormat;
+    std::chrono::steady_clock::time_point viewerStart;
+    std::chrono::steady_clock::time_point loadStart;
+    bool firstFrameShown = false;
+    FrameTimings timings;
+    std::string timingsPath;
+    FramePacer pacer;
+    bool exactPacing = false;
+    double averageDrawNs = 0.0;
+    
+    static constexpr size_t defaultCacheBudget = size_t(1024) * 1024 * 1024;
+    static constexpr size_t minCacheBudget = size_t(64) * 1024 * 1024;
+    
+    // Frames of an uncompressed pack paged in ahead of the playhead
+    static constexpr size_t packReadahead = 16;
+    static constexpr size_t streamingRingSize = 3;
 
 public:
     TimelapseViewer() = default;
@@ -30,130 +4799,881 @@ public:
         cleanup();
     }
     
-    bool initialize(const std::string& directoryPath, bool fullscreenMode, int fps) {
-        fullscreen = fullscreenMode;
-        targetFPS = fps;
+    bool initialize(const std::string& directoryPath, const ViewerOptions& options) {
+        TraceScope span("initialize");
+        viewerStart = std::chrono::steady_clock::now();
+        fullscreen = options.fullscreen;
+        targetFPS = options.fps;
+        timings.setTargetFPS(targetFPS);
+        timingsPath = options.timingsPath;
+        exactPacing = options.exactPacing;
+        decodeThreads = options.threads > 0 ? options.threads : std::thread::hardware_concurrency();
+        decodeThreads = std::max<size_t>(1, decodeThreads);
+        cacheBudgetCap = options.cacheMB * 1024 * 1024;
+        downscale = options.downscale;
+        yuvDecoding = options.yuv;
+        watchDirectory = options.watch || options.follow;
+        encodedBudgetMB = options.encodedMB;
+        compressedCacheMB = options.lz4CacheMB;
+        findDuplicates = options.dedupe || options.skipDuplicates;
+        skipDuplicates = options.skipDuplicates;
+        deltaStorage = options.delta;
+        keyframeInterval = std::max<size_t>(1, options.keyframeInterval);
+        deltaTolerance = options.deltaTolerance;
+        streamFrames = options.streamFrames;
+        if (deltaStorage && yuvDecoding) {
+            std::cerr << "Delta storage keeps RGB frames; ignoring --yuv" << std::endl;
+            yuvDecoding = false;
+        }
+        followTail = options.follow;
+#ifndef THD_WITH_LZ4
+        if (compressedCacheMB > 0) {
+            std::cerr << "The compressed frame cache needs LZ4 (rebuild with -DTHD_WITH_LZ4 -llz4); disabled" << std::endl;
+            compressedCacheMB = 0;
+        }
+#endif
+#ifndef THD_WITH_LIBJPEG
+        if (yuvDecoding) {
+            std::cerr << "YUV decoding needs libjpeg (rebuild with -DTHD_WITH_LIBJPEG -ljpeg); using RGB" << std::endl;
+            yuvDecoding = false;
+        }
+#endif
+        std::string cacheDirectory = options.diskCacheDirectory.empty() 
+            ? DiskFrameCache::defaultDirectory() : options.diskCacheDirectory;
+        if (options.sequenceIndex) {
+            indexDirectory = cacheDirectory + "/index";
+        }
+        if (options.diskCache) {
+            diskCache = std::make_unique<DiskFrameCache>();
+            if (!diskCache->open(cacheDirectory, static_cast<uint64_t>(options.diskCacheMB) * 1024 * 1024)) {
+                diskCache.reset();
+            }
+        }
         
         // Initialize SDL
-        if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-            std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+        if (!initializeSDL()) {
             return false;
         }
         
-        // Initialize SDL_image
-        int imgFlags = IMG_INIT_JPG | IMG_INIT_PNG;
-        if (!(IMG_Init(imgFlags) & imgFlags)) {
-            std::cerr << "SDL_image could not initialize! SDL_image Error: " << IMG_GetError() << std::endl;
+        // Decode straight to the renderer's own texture format
+        SDL_RendererInfo rendererInfo;
+        if (SDL_GetRendererInfo(renderer, &rendererInfo) == 0) {
+            textureFormat = preferredTextureFormat(rendererInfo, FrameCache::defaultTextureFormat);
+        }
+        frameCache.setTextureFormat(textureFormat);
+        std::cout << "Texture format: " << SDL_GetPixelFormatName(textureFormat) << std::endl;
+        
+        // JPEG's YCbCr is full range BT.601
+        if (yuvDecoding) {
+            SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+        }
+        
+        // Get actual window size (in case of fullscreen)
+        SDL_GetWindowSize(window, &windowWidth, &windowHeight);
+        updateDisplayTarget();
+        
+        // Load images from a directory or a .thd pack, or play raw video
+        TraceScope loadSpan("open sequence");
+        std::string extension = fs::path(directoryPath).extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        bool loaded = false;
+        if (directoryPath == "-" || (extension == ".y4m" && fs::is_regular_file(directoryPath))) {
+            loaded = openRawVideo(directoryPath);
+        } else if (extension == ".thd" && fs::is_regular_file(directoryPath)) {
+            loaded = openPack(directoryPath);
+        } else {
+            loaded = loadImagesFromDirectory(directoryPath);
+        }
+        if (!loaded) {
             return false;
         }
         
+        std::cout << "Initialized successfully with " << sequenceLength() << " images" << std::endl;
+        if (targetFPS > 0) {
+            std::cout << "Target framerate: " << targetFPS << " FPS" << (exactPacing ? ", exact pacing" : "") << std::endl;
+        } else {
+            std::cout << "Target framerate: unpaced" << std::endl;
+        }
+        std::cout << "Controls: Space=Play/Pause, Left/Right=Prev/Next, " 
+                  << (watcher ? "L=Follow live tail, " : "") << "ESC=Quit" << std::endl;
+        if (followTail) {
+            currentIndex = sequenceLength() - 1;
+        }
+        
+        return true;
+    }
+    
+    // SDL, SDL_image, the window and the renderer, each traced on its own
+    bool initializeSDL() {
+        {
+            TraceScope span("SDL_Init");
+            if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+                std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+                return false;
+            }
+        }
+        
+        // Initialize SDL_image
+        {
+            TraceScope span("IMG_Init");
+            int imgFlags = IMG_INIT_JPG | IMG_INIT_PNG;
+            if (!(IMG_Init(imgFlags) & imgFlags)) {
+                std::cerr << "SDL_image could not initialize! SDL_image Error: " << IMG_GetError() << std::endl;
+                return false;
+            }
+        }
+        
         // Create window
         Uint32 windowFlags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
         if (fullscreen) {
             windowFlags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
         }
         
-        window = SDL_CreateWindow("High-Speed Timelapse Viewer", 
-                                 SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 
-                                 windowWidth, windowHeight, windowFlags);
-        if (!window) {
-            std::cerr << "Window could not be created! SDL_Error: " << SDL_GetError() << std::endl;
-            return false;
+        {
+            TraceScope span("create window");
+            window = SDL_CreateWindow("High-Speed Timelapse Viewer", 
+                                     SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 
+                                     windowWidth, windowHeight, windowFlags);
+            if (!window) {
+                std::cerr << "Window could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+                return false;
+            }
         }
         
         // Create renderer
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        TraceScope span("create renderer");
+        // Exact pacing presents on its own schedule, so it cannot also wait for vsync
+        Uint32 rendererFlags = SDL_RENDERER_ACCELERATED | (exactPacing ? 0 : SDL_RENDERER_PRESENTVSYNC);
+        renderer = SDL_CreateRenderer(window, -1, rendererFlags);
         if (!renderer) {
             std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
             return false;
         }
+        return true;
+    }
+    
+    bool loadImagesFromDirectory(const std::string& directoryPath) {
+        auto scanStart = std::chrono::steady_clock::now();
+        std::string error;
         
-        // Get actual window size (in case of fullscreen)
-        SDL_GetWindowSize(window, &windowWidth, &windowHeight);
-        
-        // Load images
-        if (!loadImagesFromDirectory(directoryPath)) {
+        // Watch before scanning so files written during the scan are not missed;
+        // the ones the scan did find are ignored as duplicates
+        if (watchDirectory) {
+            watcher = std::make_unique<DirectoryWatcher>();
+            watchedDirectory = directoryPath;
+            if (!watcher->open(directoryPath, error)) {
+                std::cerr << "Unable to watch " << directoryPath << ": " << error << std::endl;
+                watcher.reset();
+            }
+        }
+        bool opened;
+        {
+            TraceScope span("scan directory");
+            opened = sequence.open(directoryPath, indexDirectory, error);
+        }
+        if (!opened) {
+            std::cerr << "Invalid directory path: " << directoryPath << " (" << error << ")" << std::endl;
             return false;
         }
+        if (sequence.size() == 0) {
+            std::cerr << "No images found in directory: " << directoryPath << std::endl;
+            return false;
+        }
+        double scanMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - scanStart).count();
+        std::cout << "Indexed " << sequence.size() << " images in " << scanMs << " ms" 
+                  << (sequence.fromSidecar() ? " (cached index)" : "") << std::endl;
         
-        std::cout << "Initialized successfully with " << imagePaths.size() << " images" << std::endl;
-        std::cout << "Target framerate: " << targetFPS << " FPS" << std::endl;
-        std::cout << "Controls: Space=Play/Pause, Left/Right=Prev/Next, ESC=Quit" << std::endl;
+        // Keep the encoded files in memory so decoding doesn't wait on the disk
+        size_t encodedBudget = static_cast<size_t>(std::max(0L, encodedBudgetMB)) * 1024 * 1024;
+        uint64_t available = 0;
+        bool cgroupLimited = false;
+        if (encodedBudgetMB < 0 && readAvailableMemory(available, cgroupLimited)) {
+            encodedBudget = static_cast<size_t>(available / 4);
+        }
+        if (encodedBudget > 0) {
+            encodedStore = std::make_unique<EncodedStore>(sequence, encodedBudget);
+            std::cout << "Encoded file cache: " << encodedBudget / (1024 * 1024) << " MB" << std::endl;
+        }
+#ifdef THD_WITH_LZ4
+        if (compressedCacheMB > 0) {
+            compressedCache = std::make_unique<CompressedFrameCache>(sequence.size(), compressedCacheMB * 1024 * 1024);
+            std::cout << "Compressed frame cache: " << compressedCacheMB << " MB" << std::endl;
+        }
+#endif
+        if (findDuplicates) {
+            createDuplicateScanner();
+        }
+        return startDecoding();
+    }
+    
+    // Opens a .thd pack. Uncompressed frames are uploaded straight from the
+    // mapping; compressed packs go through the decode pool and frame cache.
+    bool openPack(const std::string& packPath) {
+        pack = std::make_unique<ThdPack>();
+        std::string error;
+        if (!pack->open(packPath, error)) {
+            std::cerr << "Unable to open pack " << packPath << ": " << error << std::endl;
+            return false;
+        }
+        std::cout << "Opened pack " << packPath << " with " << pack->frameCount() << " frames ("
+                  << SDL_GetPixelFormatName(pack->pixelFormat()) << ")" << std::endl;
         
+        if (pack->hasCompressedFrames()) {
+            return startDecoding();
+        }
+        unreadable.assign(pack->frameCount(), 0);
+        streamingRing.reset(renderer, streamingRingSize);
+        for (size_t i = 0; i < std::min<size_t>(packReadahead, pack->frameCount()); ++i) {
+            pack->willNeed(i);
+        }
         return true;
     }
     
-    bool loadImagesFromDirectory(const std::string& directoryPath) {
-        if (!fs::exists(directoryPath) || !fs::is_directory(directoryPath)) {
-            std::cerr << "Invalid directory path: " << directoryPath << std::endl;
+    // Plays a .y4m file, or a Y4M stream on stdin when the path is "-". Frames
+    // go straight from the file or pipe into textures without decoding.
+    bool openRawVideo(const std::string& path) {
+        std::string error;
+        bool opened = false;
+        if (path == "-") {
+            auto stream = std::make_unique<Y4mStream>(STDIN_FILENO, streamFrames);
+            opened = stream->open(error);
+            rawVideo = std::move(stream);
+        } else {
+            auto file = std::make_unique<Y4mFile>();
+            opened = file->open(path, error);
+            rawVideo = std::move(file);
+        }
+        if (!opened) {
+            std::cerr << "Unable to open video " << (path == "-" ? "on stdin" : path) << ": " << error << std::endl;
+            rawVideo.reset();
             return false;
         }
         
-        // Find all image files
-        for (const auto& entry : fs::directory_iterator(directoryPath)) {
-            if (entry.is_regular_file()) {
-                std::string extension = entry.path().extension().string();
-                std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
-                
-                if (extension == ".jpg" || extension == ".jpeg" || extension == ".png" || 
-                    extension == ".bmp" || extension == ".tif" || extension == ".tiff") {
-                    imagePaths.push_back(entry.path().string());
-                }
-            }
+        const Y4mFormat& format = rawVideo->format();
+        std::cout << "Opened " << (path == "-" ? "Y4M stream on stdin" : path) << ": " << format.width << "x" 
+                  << format.height << ", " << (rawVideo->seekable() ? std::to_string(rawVideo->frameCount()) + " frames" 
+                                                                    : "reading " + std::to_string(streamFrames) + " frames ahead")
+                  << std::endl;
+        if (format.fullRange) {
+            SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+        }
+        streamingRing.reset(renderer, streamingRingSize);
+        return true;
+    }
+    
+    size_t sequenceLength() const {
+        if (rawVideo) {
+            return rawVideo->frameCount();
+        }
+        return pack ? pack->frameCount() : sequence.size();
+    }
+    
+    std::string frameName(size_t index) const {
+        if (rawVideo) {
+            return "video frame " + std::to_string(index);
         }
+        return pack ? "pack frame " + std::to_string(index) : sequence.path(index);
+    }
+    
+    bool startDecoding() {
+        TraceScope span("start decoding");
+        size_t frames = sequenceLength();
         
-        if (imagePaths.empty()) {
-            std::cerr << "No images found in directory: " << directoryPath << std::endl;
-            return false;
+        // Fill the frame cache from the start of the sequence until the budget is
+        // reached. This runs in the background while the render loop shows the
+        // frames already decoded; frames beyond the budget are decoded on demand.
+        std::cout << "Loading " << frames << " frames using " 
+                  << decodeThreads << " decode threads..." << std::endl;
+        unreadable.assign(frames, 0);
+        frameCache.reset(renderer, frames, 0);
+        loadStart = std::chrono::steady_clock::now();
+        if (deltaStorage && !pack) {
+            startDeltaBuild();
+            return true;
         }
+        updateCacheBudget();
         
-        // Sort paths alphanumerically
-        std::sort(imagePaths.begin(), imagePaths.end());
+        createDecodePool();
+        createPrefetcher();
+        prefetcher->startFill();
+        return true;
+    }
+    
+    // The frame cache takes half of the memory still free (its own textures
+    // count as free), capped by --cache-mb. Re-evaluated periodically so the
+    // cache gives memory back under pressure instead of running into the OOM killer.
+    void updateCacheBudget() {
+        lastBudgetCheck = std::chrono::steady_clock::now();
+        uint64_t available = 0;
+        bool cgroupLimited = false;
+        bool measured = false;
+        size_t budget = memoryBudget(frameCache.residentBytes(), available, cgroupLimited, measured);
         
-        // Pre-load all images into textures for maximum performance
-        std::cout << "Loading " << imagePaths.size() << " images..." << std::endl;
-        textures.resize(imagePaths.size(), nullptr);
+        // Ignore changes under 5%
+        size_t current = frameCache.budget();
+        if (current != 0 && budget > current / 20 * 19 && budget < current / 20 * 21) {
+            return;
+        }
+        std::cout << "Frame cache budget: " << budget / (1024 * 1024) << " MB";
+        if (measured) {
+            std::cout << " (" << available / (1024 * 1024) << " MB available" 
+                      << (cgroupLimited ? " below cgroup memory.max" : "") << ")";
+        }
+        std::cout << std::endl;
+        frameCache.setBudget(budget);
+    }
+    
+    // Half of the memory still free, counting `resident` bytes the caller already
+    // holds as free, capped by --cache-mb
+    size_t memoryBudget(size_t resident, uint64_t& available, bool& cgroupLimited, bool& measured) const {
+        measured = readAvailableMemory(available, cgroupLimited);
+        size_t budget = cacheBudgetCap ? cacheBudgetCap : defaultCacheBudget;
+        if (measured) {
+            size_t derived = std::max<size_t>(minCacheBudget, (available + resident) / 2);
+            budget = cacheBudgetCap ? std::min(cacheBudgetCap, derived) : derived;
+        }
+        return budget;
+    }
+    
+    bool loading() const {
+        return (prefetcher && prefetcher->isFilling()) || deltaBuilding;
+    }
+    
+    // Number of frames from the start of the sequence that are ready to show
+    size_t readyPrefix() const {
+        return deltaStore ? deltaStore->size() : prefetcher->readyPrefix();
+    }
+    
+    // Frames playback may cycle through: the loaded prefix while loading
+    size_t playableLength() const {
+        return loading() ? std::max<size_t>(1, readyPrefix()) : sequenceLength();
+    }
+    
+    void reportLoaded() {
+        auto now = std::chrono::steady_clock::now();
+        double loadSeconds = std::chrono::duration<double>(now - loadStart).count();
+        size_t loaded = deltaStore ? deltaStore->size() : prefetcher->fillCount();
+        size_t residentBytes = deltaStore ? deltaStore->residentBytes() : frameCache.residentBytes();
+        std::cout << "Loaded " << loaded << " images in " << loadSeconds << " s ("
+                  << (loadSeconds > 0 ? loaded / loadSeconds : 0.0) << " images/s, "
+                  << residentBytes / (1024 * 1024) << " MB cached)" << std::endl;
+        std::cout << "Time to fully loaded: " 
+                  << std::chrono::duration<double, std::milli>(now - viewerStart).count() << " ms" << std::endl;
+        if (deltaStore && deltaStoreFull) {
+            std::cout << "Delta store full; remaining frames will be decoded on demand" << std::endl;
+        } else if (prefetcher && prefetcher->fillReachedBudget()) {
+            std::cout << "Frame cache budget reached; remaining frames will be prefetched during playback" << std::endl;
+        }
+    }
+    
+    // With delta storage the prefetcher is not used: frames are decoded in
+    // order into the delta store until it is full, and frames past that are
+    // decoded on demand into a small frame cache
+    void startDeltaBuild() {
+        uint64_t available = 0;
+        bool cgroupLimited = false;
+        bool measured = false;
+        size_t budget = memoryBudget(0, available, cgroupLimited, measured);
+        std::cout << "Delta store budget: " << budget / (1024 * 1024) << " MB, keyframe every " 
+                  << keyframeInterval << " frames" << std::endl;
+        deltaStore = std::make_unique<DeltaFrameStore>(renderer, keyframeInterval, deltaTolerance, budget);
+        frameCache.setBudget(minCacheBudget);
+        deltaStoreFull = false;
+        createDecodePool();
+        resumeDeltaBuild();
+    }
+    
+    // Continues the build after the last stored frame
+    void resumeDeltaBuild() {
+        for (auto& item : deltaReady) {
+            SDL_FreeSurface(item.second);
+        }
+        deltaReady.clear();
+        deltaSubmitted = deltaStore->size();
+        deltaBuilding = !deltaStoreFull && deltaStore->size() < sequenceLength();
+    }
+    
+    // Called every loop iteration while the delta store is being built
+    void buildDeltaFrames() {
+        DecodedFrame frame;
+        while (decodePool->tryResult(frame)) {
+            if (!frame.surface) {
+                std::cerr << "Unable to load image " << frameName(frame.index) << ": " << frame.error << std::endl;
+                unreadable[frame.index] = 1;
+            }
+            deltaReady[frame.index] = frame.surface;
+        }
         
-        for (size_t i = 0; i < imagePaths.size(); ++i) {
-            SDL_Surface* surface = IMG_Load(imagePaths[i].c_str());
+        while (deltaBuilding && !deltaReady.empty() && deltaReady.begin()->first == deltaStore->size()) {
+            SDL_Surface* surface = deltaReady.begin()->second;
+            deltaReady.erase(deltaReady.begin());
             if (!surface) {
-                std::cerr << "Unable to load image " << imagePaths[i] << ": " << IMG_GetError() << std::endl;
+                deltaStore->appendPlaceholder();
                 continue;
             }
-            
-            textures[i] = SDL_CreateTextureFromSurface(renderer, surface);
+            bool stored = deltaStore->append(surface);
             SDL_FreeSurface(surface);
-            
-            if (!textures[i]) {
-                std::cerr << "Unable to create texture from " << imagePaths[i] << ": " << SDL_GetError() << std::endl;
+            if (!stored) {
+                deltaStoreFull = true;
+                resumeDeltaBuild();
             }
-            
-            // Show loading progress
-            if (i % 10 == 0 || i == imagePaths.size() - 1) {
-                std::cout << "Loaded " << (i + 1) << "/" << imagePaths.size() << " images\r" << std::flush;
+        }
+        
+        size_t frames = sequenceLength();
+        while (deltaBuilding && deltaSubmitted < frames && deltaSubmitted - deltaStore->size() < decodeThreads * 2) {
+            decodePool->submit(deltaSubmitted++);
+        }
+        if (deltaStore->size() == frames) {
+            deltaBuilding = false;
+        }
+    }
+    
+    void createDecodePool() {
+        decodePool = std::make_unique<DecodePool>(decodeThreads, decodeThreads * 2, [this](DecodedFrame& frame) {
+            auto start = std::chrono::steady_clock::now();
+            decodeFrame(frame);
+            timings.recordDecode(nanosecondsSince(start));
+        });
+    }
+    
+    void createDuplicateScanner() {
+        duplicatesReported = false;
+        auto scanner = std::make_shared<DuplicateScanner>(sequenceLength(), [this](size_t index) {
+            return ImageSource{sequence.path(index), encodedStore ? encodedStore->find(index) : nullptr};
+        });
+        std::lock_guard<std::mutex> lock(duplicateScannerMutex);
+        duplicateScanner = std::move(scanner);
+    }
+    
+    void stopDuplicateScanner() {
+        std::shared_ptr<DuplicateScanner> scanner;
+        {
+            std::lock_guard<std::mutex> lock(duplicateScannerMutex);
+            scanner.swap(duplicateScanner);
+        }
+    }
+    
+    // Signs a frame a decode worker just decoded (nullptr if it could not be)
+    // for the duplicate scan, unless the scanner decodes it more cheaply itself
+    void offerSignature(size_t index, const std::string& path, SDL_Surface* surface) {
+        std::shared_ptr<DuplicateScanner> scanner;
+        {
+            std::lock_guard<std::mutex> lock(duplicateScannerMutex);
+            scanner = duplicateScanner;
+        }
+        if (!scanner || DuplicateScanner::signsItself(path) || !scanner->wants(index)) {
+            return;
+        }
+        FrameSignature signature;
+        std::string error;
+        bool ok = surface && computeSignature(surface, signature, error);
+        scanner->offer(index, ok ? &signature : nullptr);
+    }
+    
+    // Points repeated frames found by the scanner at their run's texture
+    void collectDuplicates() {
+        for (const DuplicateScanner::Repeat& repeat : duplicateScanner->take()) {
+            frameCache.shareTexture(repeat.index, repeat.original);
+        }
+        if (!duplicatesReported && duplicateScanner->finished()) {
+            duplicatesReported = true;
+            std::cout << "Found " << duplicateScanner->repeatCount() << " repeated frames in " 
+                      << duplicateScanner->scannedFrames() << std::endl;
+        }
+    }
+    
+    // Next frame of playback; with duplicate skipping a run of repeats is shown
+    // once, as its first frame
+    size_t nextPlaybackFrame() const {
+        size_t length = playableLength();
+        size_t next = (currentIndex + 1) % length;
+        if (skipDuplicates && frameCache.canonical(next) != next) {
+            size_t last = frameCache.runEnd(frameCache.canonical(next));
+            next = last + 1 < length ? last + 1 : 0;
+        }
+        return next;
+    }
+    
+    void createPrefetcher() {
+        prefetcher = std::make_unique<Prefetcher>(*decodePool, frameCache, sequenceLength(), unreadable, 
+                                                  [this](size_t index) { return frameName(index); });
+        prefetcher->setTargetFPS(targetFPS > 0 ? targetFPS : 1000);
+        prefetcher->setGeneration(currentDisplayTarget().generation);
+    }
+    
+    // Adds the files the watcher reported since the last call. A camera writes
+    // names in order, so new frames normally append and decoding carries on. A
+    // name that sorts earlier renumbers the frames after it; decoding is stopped
+    // while the cache and per-frame state are shifted, then restarted.
+    void addWatchedFiles() {
+        std::vector<std::string> names;
+        if (!watcher->poll(names)) {
+            // Events were dropped; pick the missing names up from a scan
+            SequenceIndex rescan;
+            std::string error;
+            if (rescan.open(watchedDirectory, "", error)) {
+                for (size_t i = 0; i < rescan.size(); ++i) {
+                    names.push_back(fs::path(rescan.path(i)).filename().string());
+                }
             }
         }
-        std::cout << std::endl << "All images loaded successfully!" << std::endl;
         
-        return true;
+        size_t added = 0;
+        bool decodingStopped = false;
+        bool wasLoading = loading();
+        for (const std::string& name : names) {
+            size_t position = 0;
+            if (!sequence.insert(name, position)) {
+                continue;
+            }
+            added++;
+            if (position + 1 < sequence.size()) {
+                if (!decodingStopped) {
+                    prefetcher.reset();
+                    decodePool.reset();
+                    decodingStopped = true;
+                }
+                if (currentIndex >= position) {
+                    currentIndex++;
+                }
+                // Repeats are numbered by position, so scan again from the start
+                if (duplicateScanner) {
+                    stopDuplicateScanner();
+                }
+                if (deltaStore && position < deltaStore->size()) {
+                    deltaStore->truncate(position);
+                    deltaStoreFull = false;
+                }
+            }
+            unreadable.insert(unreadable.begin() + position, 0);
+            frameCache.insertFrame(position);
+            if (encodedStore) {
+                encodedStore->insertFrame(position);
+            }
+#ifdef THD_WITH_LZ4
+            if (compressedCache) {
+                compressedCache->insertFrame(position);
+            }
+#endif
+        }
+        if (added == 0) {
+            return;
+        }
+        
+        if (deltaStore) {
+            if (decodingStopped) {
+                createDecodePool();
+            }
+            resumeDeltaBuild();
+        } else if (decodingStopped) {
+            createDecodePool();
+            createPrefetcher();
+            if (wasLoading) {
+                prefetcher->startFill();
+            }
+        } else {
+            prefetcher->setFrameCount(sequenceLength());
+        }
+        if (findDuplicates && !duplicateScanner) {
+            createDuplicateScanner();
+        } else if (duplicateScanner) {
+            duplicateScanner->setFrameCount(sequenceLength());
+        }
+        std::cout << "Added " << added << " new frames (" << sequenceLength() << " total)" << std::endl;
+        
+        if (followTail && !playing) {
+            currentIndex = sequenceLength() - 1;
+            renderCurrentFrame();
+        }
+    }
+    
+    DisplayTarget currentDisplayTarget() {
+        std::lock_guard<std::mutex> lock(displayTargetMutex);
+        return displayTarget;
+    }
+    
+    // Re-reads the renderer output size. Growing it makes frames decoded for the
+    // old size stale, so they are re-derived at the new size in the background.
+    void updateDisplayTarget() {
+        int outputWidth = windowWidth;
+        int outputHeight = windowHeight;
+        SDL_GetRendererOutputSize(renderer, &outputWidth, &outputHeight);
+        
+        std::lock_guard<std::mutex> lock(displayTargetMutex);
+        bool grew = outputWidth > displayTarget.width || outputHeight > displayTarget.height;
+        if (grew && displayTarget.width > 0) {
+            displayTarget.generation++;
+        }
+        displayTarget.width = outputWidth;
+        displayTarget.height = outputHeight;
+        if (prefetcher) {
+            prefetcher->setGeneration(displayTarget.generation);
+        }
+    }
+    
+    // Decodes one frame into a surface sized for the display target and in the
+    // renderer's texture format, so the frame cache only has to copy it
+    void decodeFrame(DecodedFrame& frame, size_t resampleThreads = 1) {
+        TraceScope span("decode", static_cast<int64_t>(frame.index));
+        DisplayTarget target = currentDisplayTarget();
+        frame.generation = target.generation;
+        if (pack) {
+            frame.surface = toTextureFormat(fitToDisplay(pack->decode(frame.index, pack->pixelFormat(), frame.error), 
+                                                         target, resampleThreads, frame.error), frame);
+            return;
+        }
+        
+        // JPEGs are decoded at a reduced DCT scale for playback unless full
+        // resolution was asked for
+        ImageSource source{sequence.path(frame.index), encodedStore ? encodedStore->find(frame.index) : nullptr};
+        const std::string& path = source.path;
+        bool preview = downscale && !frame.wantFullResolution && isJpegPath(path);
+#ifndef THD_WITH_LIBJPEG
+        preview = false;
+#endif
+        
+#ifdef THD_WITH_LIBJPEG
+        // Planar YUV JPEG decodes skip the RGB conversion entirely and bypass the
+        // disk cache, which stores RGB surfaces
+        if (yuvDecoding && isJpegPath(path)) {
+            JpegScale scale;
+            std::string jpegError;
+            std::unique_ptr<YuvFrame> yuv(loadJpegYuv(source, preview ? target.width : 0, 
+                                                      preview ? target.height : 0, scale, jpegError));
+            if (yuv) {
+                frame.fullResolution = !scale.reduced;
+                sequence.recordDecode(frame.index, scale.imageWidth, scale.imageHeight);
+                int width = yuv->width;
+                int height = yuv->height;
+                if (downscale) {
+                    fitWithin(yuv->width, yuv->height, target.width, target.height, width, height);
+                }
+                if (width != yuv->width || height != yuv->height) {
+                    yuv = Resampler::resample(*yuv, width, height, resampleThreads);
+                }
+                frame.yuv = std::move(yuv);
+                return;
+            }
+        }
+#endif
+        
+#ifdef THD_WITH_LZ4
+        // Decompressing a kept frame is much cheaper than decoding it again
+        if (compressedCache) {
+            frame.surface = compressedCache->load(frame.index, target.generation, preview, resampleThreads,
+                                                  frame.fullResolution, frame.opaque);
+            if (frame.surface) {
+                offerSignature(frame.index, path, frame.surface);
+                return;
+            }
+        }
+#endif
+        
+        // Consult the disk cache before decoding. Only frames actually decoded
+        // at a reduced scale go under the preview variant; a preview that came
+        // out at 1/1 is a full resolution frame and is stored as one.
+        FrameKey key;
+        FrameKey previewKey;
+        bool cacheable = diskCache && statFrameKey(path, key);
+        if (cacheable) {
+            if (downscale) {
+                key.variant = "fit " + std::to_string(target.width) + "x" + std::to_string(target.height);
+            }
+            previewKey = key;
+            previewKey.variant += " preview";
+            if (preview && (frame.surface = diskCache->load(previewKey))) {
+                frame.fullResolution = false;
+            } else if ((frame.surface = diskCache->load(key))) {
+                frame.fullResolution = true;
+            }
+            if (frame.surface) {
+                offerSignature(frame.index, path, frame.surface);
+                frame.surface = toTextureFormat(frame.surface, frame);
+                keepCompressed(frame);
+                return;
+            }
+        }
+        
+        SDL_Surface* decoded = nullptr;
+#ifdef THD_WITH_LIBJPEG
+        if (preview) {
+            JpegScale scale;
+            std::string jpegError;
+            decoded = loadJpegScaled(source, target.width, target.height, scale, jpegError);
+            frame.fullResolution = !scale.reduced;
+            if (decoded) {
+                sequence.recordDecode(frame.index, scale.imageWidth, scale.imageHeight);
+            }
+        }
+#endif
+        if (!decoded) {
+            frame.fullResolution = true;
+            decoded = loadSurface(source, SDL_PIXELFORMAT_UNKNOWN, frame.error);
+            if (decoded) {
+                sequence.recordDecode(frame.index, decoded->w, decoded->h);
+            }
+        }
+        
+        // Converting after the downscale touches the fewest pixels
+        offerSignature(frame.index, path, decoded);
+        frame.surface = toTextureFormat(fitToDisplay(decoded, target, resampleThreads, frame.error), frame);
+        if (frame.surface && cacheable) {
+            diskCache->store(frame.fullResolution ? key : previewKey, frame.surface);
+        }
+        keepCompressed(frame);
+    }
+    
+    void keepCompressed(const DecodedFrame& frame) {
+#ifdef THD_WITH_LZ4
+        if (compressedCache && frame.surface) {
+            compressedCache->store(frame.index, frame);
+        }
+#else
+        (void)frame;
+#endif
+    }
+    
+    SDL_Surface* toTextureFormat(SDL_Surface* surface, DecodedFrame& frame) {
+        if (!surface) {
+            return nullptr;
+        }
+        frame.opaque = !SDL_ISPIXELFORMAT_ALPHA(surface->format->format) || !SDL_ISPIXELFORMAT_ALPHA(textureFormat);
+        return convertSurface(surface, textureFormat, frame.error);
+    }
+    
+    // Downscales a decoded surface to the display target, taking ownership of it
+    SDL_Surface* fitToDisplay(SDL_Surface* surface, const DisplayTarget& target, size_t threads, std::string& error) {
+        if (!surface || !downscale) {
+            return surface;
+        }
+        int width = 0;
+        int height = 0;
+        fitWithin(surface->w, surface->h, target.width, target.height, width, height);
+        if (width == surface->w && height == surface->h) {
+            return surface;
+        }
+        SDL_Surface* resized = Resampler::resample(surface, width, height, threads, error);
+        SDL_FreeSurface(surface);
+        return resized;
+    }
+    
+    // Copies an uncompressed pack frame from the mapping into the streaming ring
+    SDL_Texture* uploadPackFrame(size_t index) {
+        const ThdFrameEntry& frame = pack->entry(index);
+        const Uint8* pixels = pack->pixels(index);
+        if (!pixels) {
+            const char* problem = pack->frameProblem(index);
+            std::cerr << "Unable to load image " << frameName(index) << ": " 
+                      << (problem ? problem : "compressed frame in a pack not marked as compressed") << std::endl;
+            unreadable[index] = 1;
+            return nullptr;
+        }
+        
+        SDL_Texture* texture = streamingRing.upload(pack->pixelFormat(), frame.width, frame.height, 
+                                                    pixels, frame.pitch);
+        if (!texture) {
+            std::cerr << "Unable to upload " << frameName(index) << ": " << SDL_GetError() << std::endl;
+            return nullptr;
+        }
+        
+        // Keep the kernel paging in frames ahead of the playhead
+        size_t n = pack->frameCount();
+        pack->willNeed(playDirection > 0 ? (index + packReadahead) % n : (index + n - packReadahead % n) % n);
+        return texture;
+    }
+    
+    SDL_Texture* uploadRawFrame(size_t index) {
+        PixelPlane planes[3];
+        std::string error;
+        if (!rawVideo->planes(index, planes, error)) {
+            std::cerr << "Unable to load " << frameName(index) << ": " << error << std::endl;
+            return nullptr;
+        }
+        const Y4mFormat& format = rawVideo->format();
+        SDL_Texture* texture = streamingRing.uploadYuv(format.width, format.height, planes);
+        if (!texture) {
+            std::cerr << "Unable to upload " << frameName(index) << ": " << SDL_GetError() << std::endl;
+        }
+        return texture;
+    }
+    
+    // Returns the texture for a frame. On a cache miss this waits for the
+    // prefetcher if the frame is already being decoded, otherwise decodes it here.
+    SDL_Texture* acquireFrame(size_t index) {
+        TraceScope span("acquire", static_cast<int64_t>(index));
+        if (rawVideo) {
+            return uploadRawFrame(index);
+        }
+        frameCache.setPlayhead(index, playDirection);
+        if (SDL_Texture* texture = frameCache.find(index)) {
+            return texture;
+        }
+        if (unreadable[index]) {
+            return nullptr;
+        }
+        if (pack && !pack->hasCompressedFrames()) {
+            return uploadPackFrame(index);
+        }
+        if (deltaStore && index < deltaStore->size()) {
+            return deltaStore->present(index);
+        }
+        
+        if (playing) {
+            stalls++;
+        }
+        if (prefetcher && prefetcher->isPending(index)) {
+            TraceScope waitSpan("wait for decode", static_cast<int64_t>(index));
+            prefetcher->waitFor(index);
+            if (SDL_Texture* texture = frameCache.find(index)) {
+                return texture;
+            }
+            if (unreadable[index]) {
+                return nullptr;
+            }
+        }
+        
+        // Nothing else is decoding on this thread's behalf, so let the resampler
+        // spread the frame across all decode threads
+        DecodedFrame frame;
+        frame.index = index;
+        auto decodeStart = std::chrono::steady_clock::now();
+        decodeFrame(frame, decodeThreads);
+        timings.recordDecode(nanosecondsSince(decodeStart));
+        if (!frame.hasPixels()) {
+            std::cerr << "Unable to load image " << frameName(index) << ": " << frame.error << std::endl;
+            unreadable[index] = 1;
+            return nullptr;
+        }
+        
+        SDL_Texture* texture = frameCache.insert(index, frame);
+        SDL_FreeSurface(frame.surface);
+        if (!texture) {
+            std::cerr << "Unable to create texture from " << frameName(index) << ": " << SDL_GetError() << std::endl;
+        }
+        return texture;
     }
     
     void run() {
-        if (imagePaths.empty() || !window || !renderer) {
+        if (sequenceLength() == 0 || !window || !renderer) {
             std::cerr << "Cannot run: viewer not properly initialized" << std::endl;
             return;
         }
         
         SDL_Event e;
-        auto lastFrameTime = std::chrono::high_resolution_clock::now();
         int frameCount = 0;
-        auto fpsTimer = std::chrono::high_resolution_clock::now();
+        auto fpsTimer = std::chrono::steady_clock::now();
+        pacer.setRate(targetFPS);
         
         while (running) {
             // Handle events
             while (SDL_PollEvent(&e) != 0) {
                 if (e.type == SDL_QUIT) {
                     running = false;
+                } else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    windowWidth = e.window.data1;
+                    windowHeight = e.window.data2;
+                    updateDisplayTarget();
+                    renderCurrentFrame();
                 } else if (e.type == SDL_KEYDOWN) {
                     switch (e.key.keysym.sym) {
                         case SDLK_ESCAPE:
@@ -161,100 +5681,328 @@ public:
                             break;
                         case SDLK_SPACE:
                             playing = !playing;
+                            playDirection = 1;
+                            timings.pause();
+                            pacer.restart();
                             break;
                         case SDLK_RIGHT:
-                            if (!playing) {
-                                currentIndex = (currentIndex + 1) % imagePaths.size();
+                            if (!playing && (!rawVideo || rawVideo->seekable() || currentIndex + 1 < sequenceLength())) {
+                                playDirection = 1;
+                                currentIndex = (currentIndex + 1) % sequenceLength();
                                 renderCurrentFrame();
                             }
                             break;
                         case SDLK_LEFT:
-                            if (!playing) {
-                                currentIndex = (currentIndex + imagePaths.size() - 1) % imagePaths.size();
+                            if (!playing && (!rawVideo || rawVideo->seekable())) {
+                                playDirection = -1;
+                                currentIndex = (currentIndex + sequenceLength() - 1) % sequenceLength();
                                 renderCurrentFrame();
                             }
                             break;
+                        case SDLK_l:
+                            followTail = !followTail;
+                            std::cout << "Follow live tail " << (followTail ? "on" : "off") << std::endl;
+                            if (followTail && !playing) {
+                                currentIndex = sequenceLength() - 1;
+                                renderCurrentFrame();
+                            }
+                            break;
+                        case SDLK_t:
+                            dumpTimings();
+                            break;
                     }
                 }
             }
             
+            if (watcher) {
+                addWatchedFiles();
+            }
+            if (duplicateScanner) {
+                collectDuplicates();
+            }
+            
+            // Keep the frames ahead of the playhead decoded
+            if (encodedStore) {
+                encodedStore->setPlayhead(currentIndex, playDirection);
+            }
+#ifdef THD_WITH_LZ4
+            if (compressedCache) {
+                compressedCache->setPlayhead(currentIndex, playDirection);
+            }
+#endif
+            bool wasLoading = loading();
+            bool playheadUpdated = false;
+            if (prefetcher) {
+                TraceScope span("prefetch update");
+                playheadUpdated = prefetcher->update(currentIndex, playDirection);
+            }
+            if (playheadUpdated && !playing) {
+                renderCurrentFrame();
+            }
+            if (deltaBuilding) {
+                buildDeltaFrames();
+            }
+            
+            // While loading, keep the progress bar moving and show the frame once it arrives
+            if (wasLoading && !playing) {
+                renderCurrentFrame();
+            }
+            if (wasLoading && !loading()) {
+                reportLoaded();
+            }
+            if (prefetcher && std::chrono::steady_clock::now() - lastBudgetCheck >= std::chrono::seconds(1)) {
+                updateCacheBudget();
+            }
+            
             // Update frame if playing
             if (playing) {
-                auto currentTime = std::chrono::high_resolution_clock::now();
-                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    currentTime - lastFrameTime).count();
-                
-                // Calculate the time per frame in milliseconds
-                int msPerFrame = 1000 / targetFPS;
-                
-                // if (elapsed >= msPerFrame) {
-                if (true) {
-                    lastFrameTime = currentTime;
-                    currentIndex = (currentIndex + 1) % imagePaths.size();
-                    renderCurrentFrame();
+                // Following the live tail, or reading a stream, holds on the newest
+                // frame instead of wrapping
+                bool holdAtEnd = followTail || (rawVideo && !rawVideo->seekable());
+                if (holdAtEnd && currentIndex + 1 >= sequenceLength()) {
+                    timings.pause();
+                    pacer.restart();
+                    SDL_Delay(1);
+                } else if (pacer.remainingNs() > presentLeadNs()) {
+                    // Not due yet: sleep towards it and go round for events again
+                    pacer.sleep(presentLeadNs());
+                } else {
+                    currentIndex = nextPlaybackFrame();
+                    if (exactPacing) {
+                        renderCurrentFrame(true);
+                    } else {
+                        if (pacer.paced()) {
+                            timings.record(FrameTimings::pacingError, pacer.wait());
+                        }
+                        renderCurrentFrame();
+                    }
+                    timings.framePresented();
                     frameCount++;
                 }
                 
-                // Calculate FPS every second
-                auto fpsDuration = std::chrono::duration_cast<std::chrono::seconds>(
-                    currentTime - fpsTimer).count();
-                fpsDuration = 1;
-                // if (fpsDuration >= 1) {
-                if (true) {
+                // Show the frame rate once a second
+                auto currentTime = std::chrono::steady_clock::now();
+                double fpsSeconds = std::chrono::duration<double>(currentTime - fpsTimer).count();
+                if (fpsSeconds >= 1.0) {
                     std::string title = "High-Speed Timelapse Viewer - " + 
-                                       std::to_string(frameCount / fpsDuration) + " FPS";
+                                       std::to_string(std::lround(frameCount / fpsSeconds)) + " FPS";
+                    if (prefetcher) {
+                        title += " - " + std::to_string(stalls) + " stalls, prefetch " +
+                                 std::to_string(prefetcher->currentDepth());
+                    }
+                    title += " - " + std::to_string(bytesCopiedPerFrame() / 1024) + " KB copied/frame";
+                    if (loading()) {
+                        title += " - loading " + std::to_string(readyPrefix()) + "/" +
+                                 std::to_string(sequenceLength());
+                    }
                     SDL_SetWindowTitle(window, title.c_str());
                     frameCount = 0;
                     fpsTimer = currentTime;
                 }
             } else {
-                // If not playing, just render the current frame and wait
+                // If not playing, upgrade the current frame to full resolution and wait
+                if (prefetcher) {
+                    prefetcher->requestFullResolution(currentIndex);
+                }
                 SDL_Delay(10);
+                fpsTimer = std::chrono::steady_clock::now();
+                frameCount = 0;
             }
         }
+        
+        UploadStats uploads = uploadTotals();
+        std::cout << "Uploaded " << uploads.frames << " frames, " << bytesCopiedPerFrame() 
+                  << " bytes copied per frame" << std::endl;
+        if (diskCache) {
+            std::cout << "Disk cache: " << diskCache->hitCount() << " hits, " 
+                      << diskCache->missCount() << " misses" << std::endl;
+        }
+        if (encodedStore) {
+            std::cout << "Encoded file cache: " << encodedStore->residentFrames() << " files, "
+                      << encodedStore->residentBytes() / (1024 * 1024) << " MB, " << encodedStore->hitCount() 
+                      << " hits, " << encodedStore->missCount() << " misses" << std::endl;
+        }
+        if (deltaStore) {
+            std::cout << "Delta store: " << deltaStore->size() << " frames, " 
+                      << deltaStore->residentBytes() / (1024 * 1024) << " MB, " 
+                      << deltaStore->storedFraction() * 100.0 << "% of tiles stored" << std::endl;
+        }
+#ifdef THD_WITH_LZ4
+        if (compressedCache) {
+            std::cout << "Compressed frame cache: " << compressedCache->residentFrames() << " frames, "
+                      << compressedCache->residentBytes() / (1024 * 1024) << " MB, ratio " 
+                      << compressedCache->compressionRatio() << ":1, " << compressedCache->hitCount() << " hits, " 
+                      << compressedCache->missCount() << " misses, decompressing at " 
+                      << compressedCache->decompressMBps() << " MB/s" << std::endl;
+        }
+#endif
+        if (pacer.skipped() > 0) {
+            std::cout << "Frame pacing: " << pacer.skipped() << " frame slots skipped after falling behind" << std::endl;
+        }
+        std::cout << "Frame timings:" << std::endl;
+        timings.replace(FrameTimings::upload, uploadLatency());
+        timings.writeSummary(std::cout);
+        if (!timingsPath.empty()) {
+            dumpTimings();
+        }
+    }
+    
+    // Writes the frame timings to --timings PATH, as CSV for a .csv path and
+    // JSON otherwise, or prints them as JSON when no path was given
+    void dumpTimings() {
+        timings.replace(FrameTimings::upload, uploadLatency());
+        if (timingsPath.empty()) {
+            timings.writeJson(std::cout);
+            return;
+        }
+        std::ofstream out(timingsPath);
+        if (fs::path(timingsPath).extension() == ".csv") {
+            timings.writeCsv(out);
+        } else {
+            timings.writeJson(out);
+        }
+        if (!out) {
+            std::cerr << "Unable to write frame timings to " << timingsPath << std::endl;
+            return;
+        }
+        std::cout << "Wrote frame timings to " << timingsPath << std::endl;
+    }
+    
+    // Texture uploads are timed by each texture owner
+    LatencyHistogram uploadLatency() const {
+        LatencyHistogram total = frameCache.uploadLatency();
+        total.merge(streamingRing.uploadLatency());
+        if (deltaStore) {
+            total.merge(deltaStore->uploadLatency());
+        }
+        return total;
+    }
+    
+    UploadStats uploadTotals() const {
+        UploadStats total = frameCache.uploadStats();
+        total.frames += streamingRing.uploadStats().frames;
+        total.bytes += streamingRing.uploadStats().bytes;
+        if (deltaStore) {
+            total.frames += deltaStore->uploadStats().frames;
+            total.bytes += deltaStore->uploadStats().bytes;
+        }
+        return total;
+    }
+    
+    uint64_t bytesCopiedPerFrame() const {
+        UploadStats uploads = uploadTotals();
+        return uploads.frames ? uploads.bytes / uploads.frames : 0;
+    }
+    
+    // Time to start on a frame before it is due. Exact pacing draws the frame
+    // first and then waits to present it, so it starts earlier by the drawing time.
+    uint64_t presentLeadNs() const {
+        return FramePacer::spinNs + (exactPacing ? static_cast<uint64_t>(2 * averageDrawNs) : 0);
     }
     
-    void renderCurrentFrame() {
-        if (currentIndex >= textures.size() || !textures[currentIndex]) {
+    // With pacedPresent the frame is drawn, then presented when the pacer says it is due
+    void renderCurrentFrame(bool pacedPresent = false) {
+        if (currentIndex >= sequenceLength()) {
+            return;
+        }
+        TraceScope span("frame", static_cast<int64_t>(currentIndex));
+        auto drawStart = std::chrono::steady_clock::now();
+        
+        // While loading, a frame that is not decoded yet is left to the
+        // prefetcher rather than decoded here, so the window stays responsive
+        bool showProgress = loading();
+        SDL_Texture* texture = nullptr;
+        if (!showProgress || frameCache.find(currentIndex) || (deltaStore && currentIndex < deltaStore->size())) {
+            auto acquireStart = std::chrono::steady_clock::now();
+            texture = acquireFrame(currentIndex);
+            timings.record(FrameTimings::acquire, nanosecondsSince(acquireStart));
+        }
+        if (!texture && !showProgress) {
+            // Use up the unreadable frame's slot, or the schedule falls behind
+            // and playback races through a run of bad frames
+            if (pacedPresent && pacer.paced()) {
+                timings.record(FrameTimings::pacingError, pacer.wait());
+            }
             return;
         }
         
         // Clear screen
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
+        if (texture) {
+            drawFrame(texture);
+        }
+        if (showProgress) {
+            drawLoadingProgress();
+        }
+        
+        // Present the renderer
+        if (pacedPresent && pacer.paced()) {
+            double drawNs = static_cast<double>(nanosecondsSince(drawStart));
+            averageDrawNs = averageDrawNs == 0.0 ? drawNs : averageDrawNs * 0.9 + drawNs * 0.1;
+            timings.record(FrameTimings::pacingError, pacer.wait());
+        }
+        auto presentStart = std::chrono::steady_clock::now();
+        {
+            TraceScope presentSpan("present");
+            SDL_RenderPresent(renderer);
+        }
+        timings.record(FrameTimings::present, nanosecondsSince(presentStart));
         
+        if (texture && !firstFrameShown) {
+            firstFrameShown = true;
+            std::cout << "Time to first frame: " << std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - viewerStart).count() << " ms" << std::endl;
+        }
+    }
+    
+    // Bar along the bottom of the window; full once the cache is as full as it will get
+    void drawLoadingProgress() {
+        size_t expected = std::max<size_t>(1, deltaStore ? sequenceLength() 
+                                                         : std::min(sequenceLength(), frameCache.capacityFrames()));
+        size_t ready = std::min(readyPrefix(), expected);
+        SDL_Rect track = {0, windowHeight - 6, windowWidth, 6};
+        SDL_Rect bar = {0, windowHeight - 6, static_cast<int>(static_cast<uint64_t>(windowWidth) * ready / expected), 6};
+        SDL_SetRenderDrawColor(renderer, 48, 48, 48, 255);
+        SDL_RenderFillRect(renderer, &track);
+        SDL_SetRenderDrawColor(renderer, 80, 160, 255, 255);
+        SDL_RenderFillRect(renderer, &bar);
+    }
+    
+    void drawFrame(SDL_Texture* texture) {
         // Get texture dimensions
         int textureWidth, textureHeight;
-        SDL_QueryTexture(textures[currentIndex], NULL, NULL, &textureWidth, &textureHeight);
-        
-        // Calculate scaling to maintain aspect ratio
-        float scaleX = static_cast<float>(windowWidth) / textureWidth;
-        float scaleY = static_cast<float>(windowHeight) / textureHeight;
-        float scale = std::min(scaleX, scaleY);
-        
-        int renderWidth = static_cast<int>(textureWidth * scale);
-        int renderHeight = static_cast<int>(textureHeight * scale);
-        
-        // Center the image
-        int renderX = (windowWidth - renderWidth) / 2;
-        int renderY = (windowHeight - renderHeight) / 2;
+        SDL_QueryTexture(texture, NULL, NULL, &textureWidth, &textureHeight);
         
         // Render the texture
-        SDL_Rect renderRect = {renderX, renderY, renderWidth, renderHeight};
-        SDL_RenderCopy(renderer, textures[currentIndex], NULL, &renderRect);
-        
-        // Present the renderer
-        SDL_RenderPresent(renderer);
+        SDL_Rect renderRect = aspectFit(textureWidth, textureHeight, windowWidth, windowHeight);
+        TraceScope span("render copy");
+        auto copyStart = std::chrono::steady_clock::now();
+        SDL_RenderCopy(renderer, texture, NULL, &renderRect);
+        timings.record(FrameTimings::renderCopy, nanosecondsSince(copyStart));
     }
     
     void cleanup() {
-        // Free textures
-        for (auto& texture : textures) {
-            if (texture) {
-                SDL_DestroyTexture(texture);
-                texture = nullptr;
-            }
+        // Stop decoding before the textures and renderer go away
+        prefetcher.reset();
+        decodePool.reset();
+        rawVideo.reset();
+        for (auto& item : deltaReady) {
+            SDL_FreeSurface(item.second);
         }
+        deltaReady.clear();
+        deltaStore.reset();
+        stopDuplicateScanner();
+        encodedStore.reset();
+#ifdef THD_WITH_LZ4
+        compressedCache.reset();
+#endif
+        sequence.save();
+        
+        // Free textures
+        frameCache.clear();
+        streamingRing.clear();
+        pack.reset();
         
         // Destroy renderer and window
         if (renderer) {
@@ -273,10 +6021,558 @@ public:
     }
 };
 
+// Decodes a directory in parallel and writes the frames to a pack in order.
+// Unreadable frames get a placeholder entry, so frame numbers still match the
+// directory and playback skips them as it does with the images themselves.
+int writePack(const std::string& directoryPath, const std::string& outputPath, bool compress, int threads) {
+    SequenceIndex sequence;
+    std::string error;
+    if (!sequence.open(directoryPath, "", error)) {
+        std::cerr << "Invalid directory path: " << directoryPath << " (" << error << ")" << std::endl;
+        return 1;
+    }
+    if (sequence.size() == 0) {
+        std::cerr << "No images found in directory: " << directoryPath << std::endl;
+        return 1;
+    }
+    
+    ThdPackWriter writer;
+    if (!writer.open(outputPath, sequence.size(), FrameCache::defaultTextureFormat)) {
+        std::cerr << "Unable to create pack " << outputPath << std::endl;
+        return 1;
+    }
+    
+    size_t threadCount = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+    auto start = std::chrono::steady_clock::now();
+    std::cout << "Packing " << sequence.size() << " images using " << threadCount << " decode threads..." << std::endl;
+    
+    // Frames finish out of order; hold them until their turn, and limit how far
+    // decoding may run ahead of the writer. Unreadable frames wait as nullptr.
+    size_t window = threadCount * 4;
+    std::map<size_t, SDL_Surface*> ready;
+    size_t submitted = 0;
+    size_t nextToWrite = 0;
+    size_t unreadable = 0;
+    bool ok = true;
+    {
+        DecodePool pool(threadCount, threadCount * 2, [&sequence](DecodedFrame& frame) {
+            frame.surface = loadSurface(ImageSource{sequence.path(frame.index), nullptr}, 
+                                        FrameCache::defaultTextureFormat, frame.error);
+        });
+        while (submitted < sequence.size() && submitted < window) {
+            pool.submit(submitted++);
+        }
+        
+        DecodedFrame frame;
+        while (ok && nextToWrite < sequence.size() && pool.waitResult(frame)) {
+            if (!frame.surface) {
+                std::cerr << "Unable to load image " << sequence.path(frame.index) << ": " << frame.error << std::endl;
+            }
+            ready[frame.index] = frame.surface;
+            
+            while (ok && !ready.empty() && ready.begin()->first == nextToWrite) {
+                SDL_Surface* surface = ready.begin()->second;
+                ready.erase(ready.begin());
+                if (surface) {
+                    ok = writer.addFrame(surface, compress);
+                    SDL_FreeSurface(surface);
+                } else {
+                    writer.addPlaceholder();
+                    unreadable++;
+                }
+                nextToWrite++;
+                if (submitted < sequence.size()) {
+                    pool.submit(submitted++);
+                }
+                
+                if (nextToWrite % 10 == 0 || nextToWrite == sequence.size()) {
+                    std::cout << "Packed " << nextToWrite << "/" << sequence.size() << " images\r" << std::flush;
+                }
+            }
+        }
+    }
+    for (auto& item : ready) {
+        SDL_FreeSurface(item.second);
+    }
+    
+    if (!ok || !writer.finish()) {
+        std::cerr << std::endl << "Failed to write pack " << outputPath << std::endl;
+        return 1;
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::endl << "Wrote " << outputPath << ": " << writer.storedBytes() / (1024 * 1024) << " MB ("
+              << writer.rawBytes() / (1024 * 1024) << " MB decoded) in " << seconds << " s" << std::endl;
+    if (unreadable > 0) {
+        std::cout << unreadable << " unreadable images were packed as placeholders" << std::endl;
+    }
+    return 0;
+}
+
+// timelapse_viewer pack <dir> <out.thd>: decodes a directory in parallel and
+// writes the frames to a pack in order, ready to be mmap'd for playback
+int runPackCommand(int argc, char* argv[]) {
+    std::string directoryPath;
+    std::string outputPath;
+    bool compress = false;
+    int threads = 0;
+    
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--lz4") {
+            compress = true;
+        } else if (arg == "-t" || arg == "--threads") {
+            if (i + 1 < argc) {
+                threads = std::stoi(argv[++i]);
+            }
+        } else if (directoryPath.empty()) {
+            directoryPath = arg;
+        } else if (outputPath.empty()) {
+            outputPath = arg;
+        }
+    }
+    
+    if (directoryPath.empty() || outputPath.empty()) {
+        std::cerr << "Usage: " << argv[0] << " pack <directory> <output.thd> [--lz4] [--threads N]" << std::endl;
+        return 1;
+    }
+#ifndef THD_WITH_LZ4
+    if (compress) {
+        std::cerr << "This build has no LZ4 support (rebuild with -DTHD_WITH_LZ4 -llz4)" << std::endl;
+        return 1;
+    }
+#endif
+    
+    if (SDL_Init(0) < 0) {
+        std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+    int status = writePack(directoryPath, outputPath, compress, threads);
+    IMG_Quit();
+    SDL_Quit();
+    return status;
+}
+
+// Writes all of `bytes`, retrying short writes (pipes take a page at a time)
+bool writeFully(int fd, const void* data, size_t bytes) {
+    const Uint8* next = static_cast<const Uint8*>(data);
+    while (bytes > 0) {
+        ssize_t count = write(fd, next, bytes);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        next += count;
+        bytes -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Decodes an image to YUV 4:2:0, resized to width x height unless those are 0.
+// JPEGs are decoded straight to YUV, at a reduced DCT scale when that still
+// covers the output; other images are converted from RGB.
+std::unique_ptr<YuvFrame> decodeForExport(const ImageSource& source, int width, int height, std::string& error) {
+    std::unique_ptr<YuvFrame> yuv;
+#ifdef THD_WITH_LIBJPEG
+    if (isJpegPath(source.path)) {
+        JpegScale scale;
+        yuv.reset(loadJpegYuv(source, width, height, scale, error));
+    }
+#endif
+    if (!yuv) {
+        SDL_Surface* surface = loadSurface(source, SDL_PIXELFORMAT_UNKNOWN, error);
+        if (!surface) {
+            return nullptr;
+        }
+        if (width > 0 && (surface->w != width || surface->h != height)) {
+            SDL_Surface* resized = Resampler::resample(surface, width, height, 1, error);
+            SDL_FreeSurface(surface);
+            if (!(surface = resized)) {
+                return nullptr;
+            }
+        }
+        yuv = std::make_unique<YuvFrame>(surface->w, surface->h);
+        bool converted = SDL_ConvertPixels(surface->w, surface->h, surface->format->format, surface->pixels, 
+                                           surface->pitch, SDL_PIXELFORMAT_IYUV, yuv->pixels.data(), surface->w) == 0;
+        if (!converted) {
+            error = SDL_GetError();
+        }
+        SDL_FreeSurface(surface);
+        return converted ? std::move(yuv) : nullptr;
+    }
+    if (width > 0 && (yuv->width != width || yuv->height != height)) {
+        yuv = Resampler::resample(*yuv, width, height, 1);
+    }
+    return yuv;
+}
+
+// Writes the frames of a directory in order as a YUV4MPEG2 stream; see runExport
+int exportSequence(const std::string& directoryPath, const ViewerOptions& options) {
+    bool toStdout = options.exportPath == "-";
+    std::ostream& log = toStdout ? std::cerr : std::cout;
+    
+    SequenceIndex sequence;
+    std::string error;
+    if (!sequence.open(directoryPath, "", error)) {
+        std::cerr << "Invalid directory path: " << directoryPath << " (" << error << ")" << std::endl;
+        return 1;
+    }
+    if (sequence.size() == 0) {
+        std::cerr << "No images found in directory: " << directoryPath << std::endl;
+        return 1;
+    }
+    
+    // The first frame sets the output size unless one was given
+    std::unique_ptr<YuvFrame> first = decodeForExport(ImageSource{sequence.path(0), nullptr}, 
+                                                      options.exportWidth, options.exportHeight, error);
+    if (!first) {
+        std::cerr << "Unable to load image " << sequence.path(0) << ": " << error << std::endl;
+        return 1;
+    }
+    Y4mFormat format;
+    format.width = first->width;
+    format.height = first->height;
+    format.fullRange = true;
+    format.rateNumerator = std::max(1, options.fps);
+    
+    int fd = toStdout ? STDOUT_FILENO : ::open(options.exportPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Unable to create " << options.exportPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    // A reader that goes away should end the export with an error, not a signal
+    signal(SIGPIPE, SIG_IGN);
+    std::string header = format.header();
+    bool ok = writeFully(fd, header.data(), header.size());
+    
+    size_t threadCount = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    auto start = std::chrono::steady_clock::now();
+    log << "Exporting " << sequence.size() << " images at " << format.width << "x" << format.height 
+        << " using " << threadCount << " decode threads..." << std::endl;
+    
+    // Frames finish out of order; hold them until their turn, and limit how far
+    // decoding may run ahead of the writer
+    size_t window = threadCount * 4;
+    std::map<size_t, std::unique_ptr<YuvFrame>> ready;
+    ready[0] = std::move(first);
+    std::unique_ptr<YuvFrame> previous;
+    size_t submitted = 1;
+    size_t nextToWrite = 0;
+    uint64_t bytesWritten = header.size();
+    {
+        int width = format.width;
+        int height = format.height;
+        DecodePool pool(threadCount, threadCount * 2, [&sequence, width, height](DecodedFrame& frame) {
+            frame.yuv = decodeForExport(ImageSource{sequence.path(frame.index), nullptr}, width, height, frame.error);
+        });
+        while (submitted < sequence.size() && submitted < window) {
+            pool.submit(submitted++);
+        }
+        
+        DecodedFrame frame;
+        while (ok && nextToWrite < sequence.size()) {
+            if (!ready.count(nextToWrite)) {
+                if (!pool.waitResult(frame)) {
+                    break;
+                }
+                if (!frame.yuv) {
+                    std::cerr << "Unable to load image " << sequence.path(frame.index) << ": " << frame.error 
+                              << "; repeating the previous frame" << std::endl;
+                }
+                ready[frame.index] = std::move(frame.yuv);
+                continue;
+            }
+            
+            // An unreadable frame repeats the one before it to keep the timing
+            std::unique_ptr<YuvFrame> yuv = std::move(ready.begin()->second);
+            ready.erase(ready.begin());
+            if (yuv) {
+                previous = std::move(yuv);
+            }
+            static const char marker[] = "FRAME\n";
+            ok = writeFully(fd, marker, sizeof(marker) - 1) && 
+                 writeFully(fd, previous->pixels.data(), previous->pixels.size());
+            bytesWritten += sizeof(marker) - 1 + previous->pixels.size();
+            nextToWrite++;
+            if (submitted < sequence.size()) {
+                pool.submit(submitted++);
+            }
+            
+            if (nextToWrite % 100 == 0 || nextToWrite == sequence.size()) {
+                log << "Exported " << nextToWrite << "/" << sequence.size() << " images\r" << std::flush;
+            }
+        }
+    }
+    if (!ok) {
+        std::cerr << std::endl << "Unable to write " << (toStdout ? "to stdout" : options.exportPath) << ": " 
+                  << std::strerror(errno) << std::endl;
+    }
+    if (!toStdout && close(fd) != 0) {
+        ok = false;
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    log << std::endl << "Exported " << nextToWrite << " frames in " << seconds << " s (" 
+        << (seconds > 0 ? nextToWrite / seconds : 0.0) << " frames/s, " 
+        << (seconds > 0 ? bytesWritten / (1024.0 * 1024.0) / seconds : 0.0) << " MB/s)" << std::endl;
+    return ok ? 0 : 1;
+}
+
+// --export PATH: decodes a directory in parallel without opening a window and
+// writes the frames in order as a YUV4MPEG2 stream, to stdout when PATH is "-".
+// Frames are resized to --export-size, or else to the first frame's size.
+int runExport(const std::string& directoryPath, const ViewerOptions& options) {
+    if (SDL_Init(0) < 0) {
+        std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+    
+    // JPEG's YCbCr is full range BT.601; convert RGB sources the same way
+    SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+    int status = exportSequence(directoryPath, options);
+    IMG_Quit();
+    SDL_Quit();
+    return status;
+}
+
+// Times each stage of playback on `renderer`, whose output is windowWidth x
+// windowHeight; see runBenchmark
+int benchmarkStages(SDL_Renderer* renderer, int windowWidth, int windowHeight,
+                    const std::string& directoryPath, const ViewerOptions& options) {
+    SDL_RendererInfo rendererInfo = {};
+    SDL_GetRendererInfo(renderer, &rendererInfo);
+    Uint32 textureFormat = preferredTextureFormat(rendererInfo, FrameCache::defaultTextureFormat);
+    
+    struct Phase {
+        const char* name;
+        size_t frames = 0;
+        double seconds = 0.0;
+        uint64_t bytes = 0;
+        LatencyHistogram latency;
+    };
+    std::vector<Phase> phases(5);
+    phases[0].name = "scan";
+    phases[1].name = "decode";
+    phases[2].name = "convert";
+    phases[3].name = "upload";
+    phases[4].name = "render";
+    using Clock = std::chrono::steady_clock;
+    
+    // Scan: list and sort the directory, ignoring any saved index
+    SequenceIndex sequence;
+    std::string error;
+    auto start = Clock::now();
+    bool opened = sequence.open(directoryPath, "", error);
+    phases[0].seconds = nanosecondsSince(start) / 1e9;
+    phases[0].frames = sequence.size();
+    if (!opened || sequence.size() == 0) {
+        std::cerr << (opened ? "No images found in directory: " : "Invalid directory path: ") << directoryPath << std::endl;
+        return 1;
+    }
+    
+    // Decode: full resolution on all decode threads. A few frames of the first
+    // frame's size are kept as samples for the single-threaded stages.
+    size_t frameCount = options.benchmarkFrames > 0 ? std::min(options.benchmarkFrames, sequence.size()) : sequence.size();
+    size_t threadCount = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    const size_t sampleCount = 16;
+    std::vector<SDL_Surface*> samples;
+    std::cerr << "Benchmarking " << frameCount << " images with " << threadCount << " decode threads..." << std::endl;
+    start = Clock::now();
+    {
+        DecodePool pool(threadCount, threadCount * 2, [&sequence](DecodedFrame& frame) {
+            frame.surface = loadSurface(ImageSource{sequence.path(frame.index), nullptr}, SDL_PIXELFORMAT_UNKNOWN, frame.error);
+        });
+        for (size_t i = 0; i < frameCount; ++i) {
+            pool.submit(i);
+        }
+        DecodedFrame frame;
+        for (size_t received = 0; received < frameCount && pool.waitResult(frame); ++received) {
+            if (!frame.surface) {
+                std::cerr << "Unable to load image " << sequence.path(frame.index) << ": " << frame.error << std::endl;
+                continue;
+            }
+            struct stat info;
+            if (stat(sequence.path(frame.index).c_str(), &info) == 0) {
+                phases[1].bytes += info.st_size;
+            }
+            phases[1].frames++;
+            phases[1].latency.recordMs(frame.decodeMs);
+            bool sameSize = samples.empty() || (frame.surface->w == samples[0]->w && frame.surface->h == samples[0]->h);
+            if (samples.size() < sampleCount && sameSize) {
+                samples.push_back(frame.surface);
+            } else {
+                SDL_FreeSurface(frame.surface);
+            }
+        }
+    }
+    phases[1].seconds = nanosecondsSince(start) / 1e9;
+    if (samples.empty()) {
+        std::cerr << "No images could be decoded" << std::endl;
+        return 1;
+    }
+    int sourceWidth = samples[0]->w;
+    int sourceHeight = samples[0]->h;
+    
+    // The viewer shows frames at window size unless --no-downscale
+    SDL_Rect fit = aspectFit(sourceWidth, sourceHeight, windowWidth, windowHeight);
+    if (options.downscale && fit.w < sourceWidth) {
+        for (SDL_Surface*& sample : samples) {
+            SDL_Surface* resized = Resampler::resample(sample, fit.w, fit.h, threadCount, error);
+            if (resized) {
+                SDL_FreeSurface(sample);
+                sample = resized;
+            }
+        }
+    }
+    int width = samples[0]->w;
+    int height = samples[0]->h;
+    size_t frameBytes = static_cast<size_t>(width) * height * SDL_BYTESPERPIXEL(textureFormat);
+    
+    // Convert: decoder format to texture format, from copies made outside the timing
+    std::vector<SDL_Surface*> converted;
+    for (size_t i = 0; i < frameCount; ++i) {
+        SDL_Surface* sample = samples[i % samples.size()];
+        SDL_Surface* copy = SDL_ConvertSurfaceFormat(sample, sample->format->format, 0);
+        if (!copy) {
+            continue;
+        }
+        auto convertStart = Clock::now();
+        SDL_Surface* result = convertSurface(copy, textureFormat, error);
+        uint64_t ns = nanosecondsSince(convertStart);
+        if (!result) {
+            std::cerr << "Unable to convert to " << SDL_GetPixelFormatName(textureFormat) << ": " << error << std::endl;
+            break;
+        }
+        phases[2].seconds += ns / 1e9;
+        phases[2].frames++;
+        phases[2].bytes += frameBytes;
+        phases[2].latency.record(ns);
+        if (converted.size() < samples.size()) {
+            converted.push_back(result);
+        } else {
+            SDL_FreeSurface(result);
+        }
+    }
+    
+    // Upload: through SDL_LockTexture into a streaming texture, as playback does
+    SDL_Texture* texture = converted.empty() ? nullptr 
+        : SDL_CreateTexture(renderer, textureFormat, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!texture && !converted.empty()) {
+        std::cerr << "Unable to create a " << width << "x" << height << " texture: " << SDL_GetError() << std::endl;
+    }
+    UploadStats uploadStats;
+    for (size_t i = 0; texture && i < frameCount; ++i) {
+        SDL_Surface* surface = converted[i % converted.size()];
+        auto uploadStart = Clock::now();
+        bool uploaded = writeStreamingTexture(texture, textureFormat, width, height, surface->format->format, 
+                                              surface->pixels, surface->pitch, uploadStats);
+        uint64_t ns = nanosecondsSince(uploadStart);
+        if (!uploaded) {
+            std::cerr << "Unable to update texture: " << SDL_GetError() << std::endl;
+            break;
+        }
+        phases[3].seconds += ns / 1e9;
+        phases[3].frames++;
+        phases[3].latency.record(ns);
+    }
+    phases[3].bytes = uploadStats.bytes;
+    
+    // Render and present: letterboxed copy of the texture, with no vsync to wait on
+    SDL_Rect renderRect = aspectFit(width, height, windowWidth, windowHeight);
+    for (size_t i = 0; texture && i < frameCount; ++i) {
+        auto renderStart = Clock::now();
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, texture, NULL, &renderRect);
+        SDL_RenderPresent(renderer);
+        uint64_t ns = nanosecondsSince(renderStart);
+        phases[4].seconds += ns / 1e9;
+        phases[4].frames++;
+        phases[4].bytes += frameBytes;
+        phases[4].latency.record(ns);
+    }
+    
+    const char* videoDriver = SDL_GetCurrentVideoDriver();
+    std::cout << "{" << std::endl;
+    std::cout << "  \"video_driver\": \"" << (videoDriver ? videoDriver : "") << "\"," << std::endl;
+    std::cout << "  \"renderer\": \"" << (rendererInfo.name ? rendererInfo.name : "") << "\"," << std::endl;
+    std::cout << "  \"texture_format\": \"" << SDL_GetPixelFormatName(textureFormat) << "\"," << std::endl;
+    std::cout << "  \"threads\": " << threadCount << "," << std::endl;
+    std::cout << "  \"source_width\": " << sourceWidth << ", \"source_height\": " << sourceHeight << "," << std::endl;
+    std::cout << "  \"frame_width\": " << width << ", \"frame_height\": " << height << "," << std::endl;
+    std::cout << "  \"phases\": {" << std::endl;
+    for (size_t i = 0; i < phases.size(); ++i) {
+        const Phase& phase = phases[i];
+        double seconds = phase.seconds;
+        std::cout << "    \"" << phase.name << "\": {\"frames\": " << phase.frames << ", \"seconds\": " << seconds
+                  << ", \"frames_per_s\": " << (seconds > 0 ? phase.frames / seconds : 0.0)
+                  << ", \"mb_per_s\": " << (seconds > 0 ? phase.bytes / (1024.0 * 1024.0) / seconds : 0.0);
+        // The scan is one call, so it has no per-frame latency
+        if (phase.latency.count() > 0) {
+            std::cout << ", \"latency\": ";
+            phase.latency.writeJson(std::cout);
+        }
+        std::cout << "}" << (i + 1 < phases.size() ? "," : "") << std::endl;
+    }
+    std::cout << "  }" << std::endl;
+    std::cout << "}" << std::endl;
+    
+    for (SDL_Surface* surface : samples) {
+        SDL_FreeSurface(surface);
+    }
+    for (SDL_Surface* surface : converted) {
+        SDL_FreeSurface(surface);
+    }
+    if (texture) {
+        SDL_DestroyTexture(texture);
+    }
+    return 0;
+}
+
+// --benchmark: runs the stages of playback one at a time over the first
+// --benchmark-frames images of a directory and prints each stage's throughput
+// and latency percentiles as JSON on stdout. Without SDL_VIDEODRIVER set it
+// uses the dummy video driver, so it also runs headless with the software renderer.
+int runBenchmark(const std::string& directoryPath, const ViewerOptions& options) {
+    setenv("SDL_VIDEODRIVER", "dummy", 0);
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+        return 1;
+    }
+    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+    
+    int status = 1;
+    int windowWidth = 1280;
+    int windowHeight = 720;
+    SDL_Window* window = SDL_CreateWindow("High-Speed Timelapse Viewer", SDL_WINDOWPOS_UNDEFINED, 
+                                          SDL_WINDOWPOS_UNDEFINED, windowWidth, windowHeight, SDL_WINDOW_HIDDEN);
+    SDL_Renderer* renderer = window ? SDL_CreateRenderer(window, -1, 0) : nullptr;
+    if (renderer) {
+        status = benchmarkStages(renderer, windowWidth, windowHeight, directoryPath, options);
+        SDL_DestroyRenderer(renderer);
+    } else {
+        std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+    }
+    if (window) {
+        SDL_DestroyWindow(window);
+    }
+    IMG_Quit();
+    SDL_Quit();
+    return status;
+}
+
+#ifndef THD_NO_MAIN
 int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "pack") {
+        return runPackCommand(argc, argv);
+    }
+    
     std::string directoryPath;
-    bool fullscreen = false;
-    int fps = 240;
+    ViewerOptions options;
     
     // Parse command line arguments
     for (int i = 1; i < argc; ++i) {
@@ -287,17 +6583,127 @@ int main(int argc, char* argv[]) {
                 directoryPath = argv[++i];
             }
         } else if (arg == "-f" || arg == "--fullscreen") {
-            fullscreen = true;
+            options.fullscreen = true;
         } else if (arg == "--fps") {
             if (i + 1 < argc) {
-                fps = std::stoi(argv[++i]);
+                options.fps = std::stoi(argv[++i]);
+            }
+        } else if (arg == "-t" || arg == "--threads") {
+            if (i + 1 < argc) {
+                options.threads = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--cache-mb") {
+            if (i + 1 < argc) {
+                options.cacheMB = std::stoul(argv[++i]);
+            }
+        } else if (arg == "--no-downscale") {
+            options.downscale = false;
+        } else if (arg == "--yuv") {
+            options.yuv = true;
+        } else if (arg == "--no-index") {
+            options.sequenceIndex = false;
+        } else if (arg == "--watch") {
+            options.watch = true;
+        } else if (arg == "--follow") {
+            options.follow = true;
+        } else if (arg == "--encoded-mb") {
+            if (i + 1 < argc) {
+                options.encodedMB = std::stol(argv[++i]);
+            }
+        } else if (arg == "--lz4-cache-mb") {
+            if (i + 1 < argc) {
+                options.lz4CacheMB = std::stoul(argv[++i]);
+            }
+        } else if (arg == "--dedupe") {
+            options.dedupe = true;
+        } else if (arg == "--skip-duplicates") {
+            options.skipDuplicates = true;
+        } else if (arg == "--delta") {
+            options.delta = true;
+        } else if (arg == "--keyframe-interval") {
+            if (i + 1 < argc) {
+                options.delta = true;
+                options.keyframeInterval = std::stoul(argv[++i]);
+            }
+        } else if (arg == "--delta-tolerance") {
+            if (i + 1 < argc) {
+                options.delta = true;
+                options.deltaTolerance = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--stream-frames") {
+            if (i + 1 < argc) {
+                options.streamFrames = std::stoul(argv[++i]);
+            }
+        } else if (arg == "--export") {
+            if (i + 1 < argc) {
+                options.exportPath = argv[++i];
+            }
+        } else if (arg == "--export-size") {
+            if (i + 1 < argc && std::sscanf(argv[++i], "%dx%d", &options.exportWidth, &options.exportHeight) != 2) {
+                std::cerr << "--export-size expects WIDTHxHEIGHT" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--exact-pacing") {
+            options.exactPacing = true;
+        } else if (arg == "--trace") {
+            if (i + 1 < argc) {
+                options.tracePath = argv[++i];
+            }
+        } else if (arg == "--timings") {
+            if (i + 1 < argc) {
+                options.timingsPath = argv[++i];
+            }
+        } else if (arg == "--benchmark") {
+            options.benchmark = true;
+        } else if (arg == "--benchmark-frames") {
+            if (i + 1 < argc) {
+                options.benchmark = true;
+                options.benchmarkFrames = std::stoul(argv[++i]);
+            }
+        } else if (arg == "--disk-cache") {
+            options.diskCache = true;
+        } else if (arg == "--disk-cache-dir") {
+            if (i + 1 < argc) {
+                options.diskCache = true;
+                options.diskCacheDirectory = argv[++i];
+            }
+        } else if (arg == "--disk-cache-mb") {
+            if (i + 1 < argc) {
+                options.diskCacheMB = std::stoul(argv[++i]);
             }
         } else if (arg == "-h" || arg == "--help") {
             std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
+            std::cout << "       " << argv[0] << " pack <directory> <output.thd> [--lz4] [--threads N]" << std::endl;
             std::cout << "Options:" << std::endl;
-            std::cout << "  -d, --directory PATH   Directory containing image files" << std::endl;
+            std::cout << "  -d, --directory PATH   Directory containing image files, a .thd pack, a .y4m file," << std::endl;
+            std::cout << "                         or - for a Y4M stream on stdin" << std::endl;
+            std::cout << "  --stream-frames N      Frames to read ahead from a stream on stdin (default: 32)" << std::endl;
             std::cout << "  -f, --fullscreen       Run in fullscreen mode" << std::endl;
-            std::cout << "  --fps N                Target framerate (default: 240)" << std::endl;
+            std::cout << "  --fps N                Target framerate, 0 = as fast as possible (default: 240)" << std::endl;
+            std::cout << "  --exact-pacing         Present each frame at its deadline with vsync off, for exact rates" << std::endl;
+            std::cout << "  -t, --threads N        Image decode threads (default: all cores)" << std::endl;
+            std::cout << "  --cache-mb N           Cap the texture cache at N MB (default: half the free memory)" << std::endl;
+            std::cout << "  --encoded-mb N         Memory for encoded image files, 0 = off (default: quarter of free memory)" << std::endl;
+            std::cout << "  --lz4-cache-mb N       Keep up to N MB of decoded frames LZ4-compressed in memory (default: off)" << std::endl;
+            std::cout << "  --dedupe               Find repeated frames in the background and share their textures" << std::endl;
+            std::cout << "  --skip-duplicates      Like --dedupe, and show each run of repeated frames once" << std::endl;
+            std::cout << "  --delta                Store frames as keyframes plus changed tiles for cheaper playback" << std::endl;
+            std::cout << "  --keyframe-interval N  Frames between delta keyframes, bounding seek cost (default: 30)" << std::endl;
+            std::cout << "  --delta-tolerance N    Skip tiles that changed by at most N levels on average (default: 0)" << std::endl;
+            std::cout << "  --no-downscale         Keep frames at source resolution instead of window size" << std::endl;
+            std::cout << "  --yuv                  Decode JPEGs to planar YUV and convert on the GPU" << std::endl;
+            std::cout << "  --watch                Add frames as they are written to the directory" << std::endl;
+            std::cout << "  --follow               Watch the directory and stay on the newest frame (toggle: L)" << std::endl;
+            std::cout << "  --no-index             Rescan the directory instead of using the cached file index" << std::endl;
+            std::cout << "  --export PATH          Write the frames as Y4M to PATH (- for stdout) without a window" << std::endl;
+            std::cout << "  --export-size WxH      Resize exported frames (default: size of the first frame)" << std::endl;
+            std::cout << "  --trace PATH           Write a Chrome trace (chrome://tracing, Perfetto) of the session to PATH" << std::endl;
+            std::cout << "  --timings PATH         Write frame stage timings to PATH on exit and on T (.csv or .json)" << std::endl;
+            std::cout << "  --benchmark            Time each playback stage headless and print JSON results" << std::endl;
+            std::cout << "  --benchmark-frames N   Images to benchmark, 0 = all (default: 200)" << std::endl;
+            std::cout << "  --disk-cache           Keep decoded frames in ~/.cache/timelapse_viewer" << std::endl;
+            std::cout << "  --disk-cache-dir DIR   Keep decoded frames in DIR (implies --disk-cache)" << std::endl;
+            std::cout << "  --disk-cache-mb N      Disk cache size limit in MB (default: 8192)" << std::endl;
             std::cout << "  -h, --help             Show this help message" << std::endl;
             return 0;
         } else if (directoryPath.empty()) {
@@ -306,18 +6712,54 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    if (!options.exportPath.empty()) {
+        if (directoryPath.empty()) {
+            std::cerr << "--export needs a directory of images" << std::endl;
+            return 1;
+        }
+        return runExport(directoryPath, options);
+    }
+    if (options.benchmark) {
+        if (directoryPath.empty()) {
+            std::cerr << "--benchmark needs a directory of images" << std::endl;
+            return 1;
+        }
+        return runBenchmark(directoryPath, options);
+    }
+    
     // Prompt for directory if not provided
     if (directoryPath.empty()) {
         std::cout << "Enter path to directory containing images: ";
         std::getline(std::cin, directoryPath);
     }
     
-    TimelapseViewer viewer;
-    if (!viewer.initialize(directoryPath, fullscreen, fps)) {
-        std::cerr << "Failed to initialize viewer. Exiting." << std::endl;
-        return 1;
+    // The recorder outlives the viewer, so every thread has stopped before the trace is written
+    TraceRecorder trace;
+    if (!options.tracePath.empty()) {
+        trace.start();
+        TraceRecorder::nameThread("main");
     }
     
-    viewer.run();
-    return 0;
+    int status = 0;
+    {
+        TimelapseViewer viewer;
+        if (!viewer.initialize(directoryPath, options)) {
+            std::cerr << "Failed to initialize viewer. Exiting." << std::endl;
+            status = 1;
+        } else {
+            viewer.run();
+        }
+    }
+    
+    if (!options.tracePath.empty()) {
+        trace.stop();
+        std::string error;
+        if (trace.write(options.tracePath, error)) {
+            std::cout << "Wrote trace to " << options.tracePath << std::endl;
+        } else {
+            std::cerr << "Unable to write trace " << options.tracePath << ": " << error << std::endl;
+        }
+    }
+    return status;
 }
+#endif